@@ -29,6 +29,7 @@
 
 //////////// PRIVACY-PRESERVING READ ALIGNMENT ////////////
 void phase1_minhash(const ref_t& ref, reads_t& reads);
+void prepare_kmer2_ciphers(const char* fastaName, ref_t& ref, reads_t& reads);
 void phase2_encryption(reads_t& reads, const ref_t& ref, std::vector<voting_task*>& encrypt_kmer_buffers);
 void phase2_voting(std::vector<voting_task*>& encrypt_kmer_buffers, std::vector<voting_results>& results, voting_stats& stats);
 void phase2_monolith(reads_t& reads, const ref_t& ref, std::vector<voting_results>& voting_results,  voting_stats& stats);
@@ -50,13 +51,15 @@ void balaur_main(const char* fastaName, ref_t& ref, reads_t& reads, precomp_cont
 	filter_candidate_contigs(reads);
 
 	// --- phase 2 ---
-	load_kmer2_hashes(fastaName, ref, params);
+	prepare_kmer2_ciphers(fastaName, ref, reads);
 	std::vector<voting_results> results;
 	voting_stats stats;
 	if(params->monolith) {
 		phase2_monolith(reads, ref, results, stats);
 	} else {
-		load_repeat_info(fastaName, ref, params);
+		if(ref.bundle.neighbor_repeats == NULL && ref.precomputed_neighbor_repeats.size() != ref.len - params->k2 + 1) { // (not mapped from the reference bundle or loaded by a previous batch)
+			load_repeat_info(fastaName, ref, params);
+		}
 		std::vector<voting_task*> encrypt_kmer_buffers;
 		phase2_encryption(reads, ref, encrypt_kmer_buffers);
 		phase2_voting(encrypt_kmer_buffers, results, stats);
@@ -76,8 +79,15 @@ void phase1_minhash(const ref_t& ref, reads_t& reads) {
 		read_t* r = &reads.reads[i];
 		r->minhashes_f.resize(params->h);
 		r->minhashes_rc.resize(params->h);
-		r->valid_minhash_f = minhash(r->seq, ref.high_freq_kmer_bitmap, r->minhashes_f);
-		r->valid_minhash_rc = minhash(r->rc, ref.high_freq_kmer_bitmap, r->minhashes_rc);
+		if(params->n_probes > 0 && params->load_mhi) {
+			r->next_minhashes_f.resize(params->h);
+			r->next_minhashes_rc.resize(params->h);
+			r->valid_minhash_f = minhash_next(r->seq, ref.high_freq_kmers, r->minhashes_f, r->next_minhashes_f);
+			r->valid_minhash_rc = minhash_next(r->rc, ref.high_freq_kmers, r->minhashes_rc, r->next_minhashes_rc);
+		} else {
+			r->valid_minhash_f = minhash(r->seq, ref.high_freq_kmers, r->minhashes_f);
+			r->valid_minhash_rc = minhash(r->rc, ref.high_freq_kmers, r->minhashes_rc);
+		}
 	}
 	printf("Runtime (fingerprints): %.2f sec\n", omp_get_wtime() - t);
 	if(!params->load_mhi) return;
@@ -87,6 +97,28 @@ void phase1_minhash(const ref_t& ref, reads_t& reads) {
 	printf("Runtime time (total): %.2f sec\n", omp_get_wtime() - t);
 }
 
+// set up the reference kmer2 ciphers of the candidate contigs (--kmer2-mode)
+// falls back to computing them on demand if the precomputed hashes are missing
+void prepare_kmer2_ciphers(const char* fastaName, ref_t& ref, reads_t& reads) {
+	const seq_t n_kmers = ref.len - params->k2 + 1;
+	kmer2_ciphers_t& c = ref.kmer2_ciphers;
+	if(c.all_hashes == NULL && !c.no_precomputed && params->kmer2_mode != KMER2_ON_DEMAND) { // (not mapped from the reference bundle or loaded by a previous batch)
+		if(params->kmer2_mode == KMER2_LOAD) {
+			if(load_kmer2_hashes(fastaName, ref, params) && ref.precomputed_kmer2_hashes.size() == n_kmers) {
+				c.all_hashes = ref.precomputed_kmer2_hashes.data();
+			}
+		} else {
+			map_kmer2_hashes(fastaName, ref, params);
+		}
+		if(c.all_hashes == NULL) {
+			c.no_precomputed = true;
+			printf("No precomputed kmer2 hashes found for %s, computing the contig ciphers on demand\n", fastaName);
+		}
+	}
+	if(c.all_hashes != NULL) return;
+	compute_contig_kmer2_ciphers(ref, reads, params);
+}
+
 // encrypt the read and contig kmers
 void allocate_encrypt_kmer_buffers(reads_t& reads, std::vector<voting_task*>& encrypt_kmer_buffers);
 void populate_encrypt_kmer_buffers(reads_t& reads, const ref_t& ref, std::vector<voting_task*>& encrypt_kmer_buffers);
@@ -216,6 +248,7 @@ void allocate_encrypt_kmer_buffers(reads_t& reads, std::vector<voting_task*>& en
 }
 
 void populate_encrypt_kmer_buffers(reads_t& reads, const ref_t& ref, std::vector<voting_task*>& encrypt_kmer_buffers) {
+	const uint16_t* repeat_info = (ref.bundle.neighbor_repeats != NULL) ? ref.bundle.neighbor_repeats : ref.precomputed_neighbor_repeats.data();
 	for(size_t i = 0; i < encrypt_kmer_buffers.size(); i++) {
 		voting_task* task = encrypt_kmer_buffers[i];
 		read_t* r = &reads.reads[task->rid];
@@ -244,10 +277,13 @@ void populate_encrypt_kmer_buffers(reads_t& reads, const ref_t& ref, std::vector
 		int contig_id = 0;
 		for(int j = task->start; j < task->end; j++) {
 			if(!r->ref_matches[j].valid) continue;
-			if(params->vanilla) {
-				 lookup_vanilla_ciphers(task->get_contig(contig_id), r->ref_matches[j].pos, r->ref_matches[j].len, ref.precomputed_kmer2_hashes);
+			const kmer_cipher_t* contig_hashes = ref.kmer2_ciphers.get(r->ref_matches[j].pos);
+			if(contig_hashes == NULL) {
+				task->clear_contig(contig_id);
+			} else if(params->vanilla) {
+				 lookup_vanilla_ciphers(task->get_contig(contig_id), r->ref_matches[j].len, contig_hashes);
 			} else {
-				lookup_sha1_ciphers(task->get_contig(contig_id), true, r->ref_matches[j].pos, r->ref_matches[j].len, ref.precomputed_kmer2_hashes, ref.precomputed_neighbor_repeats);
+				lookup_sha1_ciphers(task->get_contig(contig_id), true, r->ref_matches[j].pos, r->ref_matches[j].len, contig_hashes, repeat_info);
 			}
 			contig_id++;
 #if(SIM_EVAL)
@@ -283,7 +319,12 @@ void phase2_monolith(reads_t& reads, const ref_t& ref, std::vector<voting_result
 				int contig_id = 0;
 				for(int j = 0; j < r.n_match_f; j++) {
 					if(!r.ref_matches[j].valid) continue;
-					lookup_vanilla_ciphers(task->get_contig(contig_id), r.ref_matches[j].pos, r.ref_matches[j].len, ref.precomputed_kmer2_hashes);
+					const kmer_cipher_t* contig_hashes = ref.kmer2_ciphers.get(r.ref_matches[j].pos);
+					if(contig_hashes == NULL) {
+						task->clear_contig(contig_id);
+					} else {
+						lookup_vanilla_ciphers(task->get_contig(contig_id), r.ref_matches[j].len, contig_hashes);
+					}
 					contig_id++;
 					
 				#if(SIM_EVAL)
@@ -312,7 +353,12 @@ void phase2_monolith(reads_t& reads, const ref_t& ref, std::vector<voting_result
 				int contig_id = 0;
 				for(int j = r.n_match_f; j < r.ref_matches.size(); j++) {
 					if(!r.ref_matches[j].valid) continue;
-					lookup_vanilla_ciphers(task->get_contig(contig_id), r.ref_matches[j].pos, r.ref_matches[j].len, ref.precomputed_kmer2_hashes);
+					const kmer_cipher_t* contig_hashes = ref.kmer2_ciphers.get(r.ref_matches[j].pos);
+					if(contig_hashes == NULL) {
+						task->clear_contig(contig_id);
+					} else {
+						lookup_vanilla_ciphers(task->get_contig(contig_id), r.ref_matches[j].len, contig_hashes);
+					}
 					contig_id++;
 				#if(SIM_EVAL)
                                         r.get_sim_read_info(ref);
@@ -1,12 +1,13 @@
 #include "contigs.h"
 #include <bitset>
+#include <algorithm>
 
 // Priority heap support (used to process reference index buckets)
 struct heap_entry_t {
 	seq_t pos;
 	uint32_t len;
 	uint16_t tid;
-	uint16_t next_idx;
+	uint32_t next_idx; // (buckets are at most MAX_SEARCHED_BUCKET_SIZE entries)
 };
 
 struct heap_ops {	
@@ -105,24 +106,24 @@ struct heap_ops {
 int get_next_contig(const ref_t& ref, const std::vector<std::pair<uint64, minhash_t> >& ref_bucket_matches_by_table, uint32 t, heap_entry_t* entry) {
 	const minhash_t read_proj_hash = ref_bucket_matches_by_table[t].second;
 	const uint64 bid = ref_bucket_matches_by_table[t].first;
-	if(bid == ref.index.bucket_offsets.size()) { // table ignored
+	if(bid == ref.index.n_offsets) { // table ignored
 		return 0;
 	}
-	const uint64 bucket_data_offset = ref.index.bucket_offsets[bid];
-	const uint64 bucket_data_size = ref.index.bucket_offsets[bid+1] - bucket_data_offset;
+	const uint64 bucket_data_offset = ref.index.bucket_start(bid);
+	const uint64 bucket_data_size = ref.index.bucket_size(bid);
 	// get the next entry in the bucket that matches the read projection hash value
 	bool first = entry->next_idx == 0;
 	if(first) {
-		loc_t l;
-		l.hash = read_proj_hash;
-		l.pos = 0;
-		l.len = 0;
-		std::vector<loc_t>::const_iterator range_start = std::lower_bound(ref.index.buckets_data.begin() + bucket_data_offset, ref.index.buckets_data.begin() + bucket_data_offset + bucket_data_size, l, comp_loc()); 	
-		entry->next_idx = std::distance(ref.index.buckets_data.begin() + bucket_data_offset, range_start);
+		entry->next_idx = ref.index.bucket_lower_bound(bid, read_proj_hash);
 	}
-	if(ref.index.buckets_data[bucket_data_offset + entry->next_idx].hash == read_proj_hash) {
-		entry->pos = ref.index.buckets_data[bucket_data_offset + entry->next_idx].pos;
-		entry->len = ref.index.buckets_data[bucket_data_offset + entry->next_idx].len;
+	if(entry->next_idx >= bucket_data_size) {
+		return 0;
+	}
+	loc_t l;
+	ref.index.get_entry(bid, bucket_data_offset + entry->next_idx, l);
+	if(l.hash == read_proj_hash) {
+		entry->pos = l.pos;
+		entry->len = l.len;
 		entry->tid = t;
 		entry->next_idx++;
 		return 1;
@@ -130,7 +131,7 @@ int get_next_contig(const ref_t& ref, const std::vector<std::pair<uint64, minhas
 	return 0;
 }
 
-void process_contig(ref_match_t contig, read_t* r) {
+void process_contig(const ref_t& ref, ref_match_t contig, read_t* r) {
 	// filters
 	if(contig.len > params->max_matched_contig_len) return;
 	if(contig.n_diff_bucket_hits < (int) params->min_n_hits) return;
@@ -140,8 +141,13 @@ void process_contig(ref_match_t contig, read_t* r) {
 	if(contig.n_diff_bucket_hits > r->best_n_bucket_hits) { // if more hits than best so far
 		r->best_n_bucket_hits = contig.n_diff_bucket_hits;
 	}
-	contig.pos = (contig.pos >= CONTIG_PADDING) ? contig.pos - CONTIG_PADDING : 0;
-	contig.len += 2*CONTIG_PADDING + r->len;
+	// with a strided index the read can start up to a stride away from the sampled window
+	const seq_t padding = std::max((seq_t) CONTIG_PADDING, (seq_t) params->ref_window_stride);
+	contig.pos = (contig.pos >= padding) ? contig.pos - padding : 0;
+	contig.len += 2*padding + r->len;
+	if(contig.len > ref.len - contig.pos) { // (the contig kmer2s must lie within the reference)
+		contig.len = ref.len - contig.pos;
+	}
 	r->ref_matches.push_back(contig);
 	r->n_proc_contigs++;
 }
@@ -159,10 +165,13 @@ void find_candidate_contigs(const ref_t& ref, read_t* r, const bool rc) {
 	r->ref_matches.reserve(10);
 
 	// priority heap of matched positions
-	heap_entry_t heap[params->n_tables];
+	// (with multi-probe queries each table is searched in several buckets, the heap tid is the probed bucket)
+	const uint32 n_probed_buckets = (rc ? r->ref_bucket_matches_by_table_rc : r->ref_bucket_matches_by_table_f).size();
+	const uint32 n_table_probes = n_probed_buckets / params->n_tables;
+	heap_entry_t heap[n_probed_buckets];
 	int heap_size = 0;
 	// push the first entries in each sorted bucket onto the heap
-	for(uint32 t = 0; t < params->n_tables; t++) { // for each table
+	for(uint32 t = 0; t < n_probed_buckets; t++) { // for each probed bucket
 		heap[heap_size].next_idx = 0;
 		if(get_next_contig(ref, (rc ? r->ref_bucket_matches_by_table_rc : r->ref_bucket_matches_by_table_f), t, &heap[heap_size]) > 0) {
 			heap_size++;
@@ -186,21 +195,21 @@ void find_candidate_contigs(const ref_t& ref, read_t* r, const bool rc) {
 				len += e_last_pos - last_pos;
 				last_pos = e_last_pos;
 			}
-			if(!occ.test(e.tid)) {
+			if(!occ.test(e.tid / n_table_probes)) {
 				n_diff_table_hits++;
 			}
-			occ.set(e.tid);
+			occ.set(e.tid / n_table_probes);
 		} else {
 			// found a boundary, store/handle last contig
 			ref_match_t contig(last_pos - len + 1, len, rc, n_diff_table_hits);
-			process_contig(contig, r);
+			process_contig(ref, contig, r);
 
 			// start a new contig
 			n_diff_table_hits = 1;
 			len = e.len - 1;
 			last_pos = e_last_pos;
 			occ.reset();
-			occ.set(e.tid);
+			occ.set(e.tid / n_table_probes);
 		}
 		// push the next match from this bucket
 		if(get_next_contig(ref, (rc ? r->ref_bucket_matches_by_table_rc : r->ref_bucket_matches_by_table_f), e.tid, &heap[0]) > 0) {
@@ -214,43 +223,74 @@ void find_candidate_contigs(const ref_t& ref, read_t* r, const bool rc) {
 	// add the last position
 	if(last_pos != (seq_t) -1) {
 		ref_match_t contig(last_pos - len + 1, len, rc, n_diff_table_hits);
-		process_contig(contig, r);
+		process_contig(ref, contig, r);
 	}
 }
 
+// multi-probe perturbations: sets of projection values to replace by their next smallest value,
+// ordered by the number of replaced values (at most 2^sketch_proj_len - 1)
+static void get_probe_masks(std::vector<uint32>& probe_masks) {
+	for(uint32 n_bits = 1; n_bits <= params->sketch_proj_len; n_bits++) {
+		for(uint32 mask = 1; mask < (1U << params->sketch_proj_len); mask++) {
+			if(probe_masks.size() == params->n_probes) return;
+			if((uint32) __builtin_popcount(mask) == n_bits) {
+				probe_masks.push_back(mask);
+			}
+		}
+	}
+}
+
+// sets the buckets to search in each table for the given read fingerprint:
+// the bucket of the read projection followed by the buckets of the perturbed projections
+// (hot buckets and perturbations without a next smallest value are ignored)
+// returns true if any bucket can be searched
+static bool set_bucket_matches(const ref_t& ref, const VectorMinHash& minhashes, const VectorMinHash& next_minhashes,
+		const std::vector<uint32>& probe_masks, std::vector<std::pair<uint64, minhash_t> >& bucket_matches) {
+	const uint32 n_table_probes = probe_masks.size() + 1;
+	bucket_matches.resize(params->n_tables*n_table_probes);
+	bool any_bucket_hits = false;
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		const uint32 proj_offset = t*params->sketch_proj_len;
+		const minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(minhashes, params->sketch_proj_indices, proj_offset);
+		for(uint32 p = 0; p < n_table_probes; p++) {
+			std::pair<uint64, minhash_t>& match = bucket_matches[t*n_table_probes + p];
+			match = std::pair<uint64, minhash_t>(ref.index.n_offsets, 0); // bucket ignored
+			minhash_t probe_hash = proj_hash;
+			bool valid_probe = true;
+			for(uint32 i = 0; p > 0 && i < params->sketch_proj_len; i++) {
+				if(!(probe_masks[p-1] & (1U << i))) continue;
+				const uint32 idx = params->sketch_proj_indices[proj_offset + i];
+				if(next_minhashes[idx] == minhashes[idx] || next_minhashes[idx] == UINT_MAX) {
+					valid_probe = false;
+					break;
+				}
+				probe_hash = params->sketch_proj_hash_func.update_vector(probe_hash, i, minhashes[idx], next_minhashes[idx]);
+			}
+			if(!valid_probe) continue;
+			const uint64_t bid = t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(probe_hash);
+			if(ref.index.bucket_skipped(bid)) continue; // hot bucket (marked at index time)
+			match = std::pair<uint64, minhash_t>(bid, probe_hash);
+			any_bucket_hits = true;
+			//_mm_prefetch((const void *)&ref.index.entries[ref.index.bucket_start(bid)],_MM_HINT_T0);
+		}
+	}
+	return any_bucket_hits;
+}
+
 ///// project and merge the resulting buckets
 void assemble_candidate_contigs(const ref_t& ref, reads_t& reads) {
+	std::vector<uint32> probe_masks;
+	get_probe_masks(probe_masks);
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		if(r->valid_minhash_f) {
-			r->ref_bucket_matches_by_table_f.resize(params->n_tables);
-			for(uint32 t = 0; t < params->n_tables; t++) {
-				const minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(r->minhashes_f, params->sketch_proj_indices, t*params->sketch_proj_len);
-				const uint64_t bid = t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(proj_hash);
-				const uint32 bucket_size = ref.index.bucket_offsets[bid + 1] - ref.index.bucket_offsets[bid];
-				if(bucket_size > MAX_BUCKET_SIZE) {
-					r->ref_bucket_matches_by_table_f[t] = std::pair<uint64, minhash_t>(ref.index.bucket_offsets.size(), 0);
-					continue;
-				}
-				r->ref_bucket_matches_by_table_f[t] = std::pair<uint64, minhash_t>(bid, proj_hash);
-				//_mm_prefetch((const void *)&ref.index.buckets_data[ref.index.bucket_offsets[bid]],_MM_HINT_T0);
-			}
+			set_bucket_matches(ref, r->minhashes_f, r->next_minhashes_f, probe_masks, r->ref_bucket_matches_by_table_f);
 			find_candidate_contigs(ref, r, false);
 			r->n_match_f = r->ref_matches.size();
 		}
 		if(r->valid_minhash_rc) {
-			r->ref_bucket_matches_by_table_rc.resize(params->n_tables);
-			for(uint32 t = 0; t < params->n_tables; t++) {
-				const minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(r->minhashes_rc, params->sketch_proj_indices, t*params->sketch_proj_len);
-				const uint64_t bid = t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(proj_hash);
-				uint32 bucket_size = ref.index.bucket_offsets[bid + 1] - ref.index.bucket_offsets[bid];
-				if(bucket_size > MAX_BUCKET_SIZE) {
-					r->ref_bucket_matches_by_table_rc[t] = std::pair<uint64, minhash_t>(ref.index.bucket_offsets.size(), 0);
-					continue;
-				}
+			if(set_bucket_matches(ref, r->minhashes_rc, r->next_minhashes_rc, probe_masks, r->ref_bucket_matches_by_table_rc)) {
 				r->any_bucket_hits = true;
-				r->ref_bucket_matches_by_table_rc[t] = std::pair<uint64, minhash_t>(bid, proj_hash);
-				//_mm_prefetch((const char *)&ref.index.buckets_data[ref.index.bucket_offsets[bid]],_MM_HINT_T0);
 			}
 			find_candidate_contigs(ref, r, true);
 		}
@@ -7,7 +7,6 @@
 
 #define N_TABLES_MAX 1024
 #define CONTIG_PADDING 50
-#define MAX_BUCKET_SIZE 1000
 
 void assemble_candidate_contigs(const ref_t& ref, reads_t& reads);
 void filter_candidate_contigs(reads_t& reads);
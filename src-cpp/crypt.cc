@@ -14,16 +14,13 @@
 uint8_t blake2_key[KEY_LEN];
 void generate_sha1_ciphers(kmer_cipher_t* ciphers, const char* seq, const seq_t seq_len, const std::vector<bool>& repeat_mask, bool rev_mask) {
 		const int n_kmers = get_n_kmers(seq_len, params->k2);
-		uint32_t hash[5];
+		if(n_kmers <= 0) return;
+		sha1_kmer_ciphers(seq, params->k2, n_kmers, ciphers);
 		for(int i = 0; i < n_kmers; i++) {
 			int mask_idx = i;
 			if(rev_mask) mask_idx = n_kmers-i-1;
 			if(repeat_mask[mask_idx]) {
 				ciphers[i]  = genrand64_int64();
-			} else {
-				sha1_hash(reinterpret_cast<const uint8_t*>(&seq[i]), params->k2, hash);
-				ciphers[i] = ((uint64) hash[0] << 32 | hash[1]);
-				//blake2bp(reinterpret_cast<uint8_t*>(&ciphers[i]), reinterpret_cast<const void*>(&seq[i]), blake2_key, 8, params->k2, 0);//KEY_LEN);
 			}
 		}
 }
@@ -64,7 +61,7 @@ void mask_repeats(kmer_cipher_t* ciphers, const int n_ciphers) {
 	}
 }
 
-void compute_repeat_mask(const seq_t offset, const int len, const std::vector<uint16_t>& repeat_info, std::vector<bool>& repeat_mask, const int bin_size) {
+void compute_repeat_mask(const seq_t offset, const int len, const uint16_t* repeat_info, std::vector<bool>& repeat_mask, const int bin_size) {
 	for(int i = 0; i < len; i++) {
 		const uint16_t r = repeat_info[offset + i]; // distance to closest repeat
 		const seq_t next_occ =  i + r;
@@ -81,7 +78,7 @@ void compute_repeat_mask(const seq_t offset, const int len, const std::vector<ui
 	}
 }
 
-inline bool test_and_set_repeat(const seq_t local_pos, const seq_t offset, const int len, const std::vector<uint16_t>& repeat_info, std::vector<bool>& repeat_mask) {
+inline bool test_and_set_repeat(const seq_t local_pos, const seq_t offset, const int len, const uint16_t* repeat_info, std::vector<bool>& repeat_mask) {
 	const uint16_t r = repeat_info[local_pos + offset]; // distance to closest repeat
 	const seq_t next_occ = local_pos + r;
         if(r == 0 || next_occ >= len) return repeat_mask[local_pos];
@@ -91,16 +88,16 @@ inline bool test_and_set_repeat(const seq_t local_pos, const seq_t offset, const
 
 
 // strided lookup of precomputed ref kmers (access pattern stored in the shuffle array)
-void gather_sha1_ciphers(kmer_cipher_t* ciphers, const std::vector<int>& shuffle, const int shuffle_len, const seq_t offset, const std::vector<kmer_cipher_t>& precomp_ref_hashes) {
+void gather_sha1_ciphers(kmer_cipher_t* ciphers, const std::vector<int>& shuffle, const int shuffle_len, const kmer_cipher_t* ref_hashes) {
 	for(int i = 0; i < shuffle_len; i++) {
-		ciphers[i] = precomp_ref_hashes[offset + shuffle[i]];
+		ciphers[i] = ref_hashes[shuffle[i]];
 	}
 }
 
 // contig hashing
-// lookup precomputed sha-1 hashes
+// lookup precomputed sha-1 hashes (contig_hashes: hashes of the contig kmers starting at offset)
 // mask repeats
-void  lookup_sha1_ciphers(kmer_cipher_t* ciphers, const bool any_repeats, const seq_t offset, const seq_t len, const std::vector<kmer_cipher_t>& precomp_ref_hashes, const std::vector<uint16_t>& repeat_info) {
+void  lookup_sha1_ciphers(kmer_cipher_t* ciphers, const bool any_repeats, const seq_t offset, const seq_t len, const kmer_cipher_t* contig_hashes, const uint16_t* repeat_info) {
 	const int n_kmers = get_n_kmers(len, params->k2);
 	const int n_bins = ceil(((float)n_kmers)/params->bin_size);
 	int bin_size = params->bin_size;
@@ -118,7 +115,7 @@ void  lookup_sha1_ciphers(kmer_cipher_t* ciphers, const bool any_repeats, const
 			if(repeat_mask[pos]) {
 				ciphers[i] = genrand64_int64();
 			} else {
-				ciphers[i] = precomp_ref_hashes[offset + pos];
+				ciphers[i] = contig_hashes[pos];
 			}
 		}
 		return;
@@ -146,17 +143,17 @@ void  lookup_sha1_ciphers(kmer_cipher_t* ciphers, const bool any_repeats, const
 			n_unique = 0;
 		}
 
-		gather_sha1_ciphers(&ciphers[cipher_offset], shuffle, n_unique, offset + kmer_offset, precomp_ref_hashes); // fill in the sampled hashes
+		gather_sha1_ciphers(&ciphers[cipher_offset], shuffle, n_unique, &contig_hashes[kmer_offset]); // fill in the sampled hashes
 		for(int j = n_unique; j < n_sampled; j++) {
 			ciphers[cipher_offset + j] = genrand64_int64();
 		}
 	}
 }
 
-void  lookup_vanilla_ciphers(kmer_cipher_t* ciphers, const seq_t offset, const seq_t len, const std::vector<kmer_cipher_t>& precomp_ref_hashes) {
+void  lookup_vanilla_ciphers(kmer_cipher_t* ciphers, const seq_t len, const kmer_cipher_t* contig_hashes) {
 	const int n_sampled_kmers = get_n_sampled_kmers(len, params->k2, params->sampling_intv);
 	for(int i = 0; i < n_sampled_kmers; i++) {
 		seq_t pos = i*params->sampling_intv;
-		ciphers[i] = precomp_ref_hashes[offset + pos];
+		ciphers[i] = contig_hashes[pos];
 	}
 }
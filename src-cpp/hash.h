@@ -21,6 +21,7 @@ extern "C"
 #endif
 
 void sha1_hash(const uint8_t *message, uint32_t len, uint32_t hash[5]);
+void sha1_kmer_ciphers(const char* seq, const uint32 k, const uint64 n_kmers, uint64* ciphers);
 
 // universal hash function:
 // single value: a*x mod n_buckets
@@ -59,6 +60,11 @@ struct rand_hash_function_t {
 		//return (minhash_t) s >> (w - M);
 	}
 
+	// projection after replacing the value at position i of the projected vector (the projection is linear)
+	minhash_t update_vector(const minhash_t vector_prod, const uint32 i, const minhash_t old_x, const minhash_t new_x) const {
+		return (minhash_t) (vector_prod + a_vec[i]*((uint64) new_x - old_x));
+	}
+
 	minhash_t bucket_hash(const minhash_t vector_prod) const {
 		return (minhash_t) vector_prod >> (w - M);
 	}
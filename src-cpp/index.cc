@@ -1,10 +1,15 @@
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <algorithm>
 #include <time.h>
 #include <limits.h>
+#include <queue>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
 #include "types.h"
 #include "index.h"
 #include "lsh.h"
@@ -22,6 +27,110 @@
 // - sort buckets
 
 #define REPORT_WINDOW_PROC_GRANULARITY 2000000
+#define KMER_HASH_STREAM_CHUNK (1 << 16) // number of windows per thread kmer hash range
+#define REF_TILE_SIZE (1 << 16) // number of windows per scheduled tile
+
+// per-thread window tile processing times
+struct tile_stats_t {
+	uint32 n_tiles;
+	double total_time;
+	double max_time;
+
+	tile_stats_t() : n_tiles(0), total_time(0), max_time(0) {}
+	void add_tile(const double time) {
+		n_tiles++;
+		total_time += time;
+		if(time > max_time) max_time = time;
+	}
+};
+
+static void print_tile_stats(const std::vector<tile_stats_t>& thread_tile_stats, const double wall_time) {
+	double total_busy = 0;
+	for(uint32 tid = 0; tid < thread_tile_stats.size(); tid++) {
+		const tile_stats_t& s = thread_tile_stats[tid];
+		printf("Thread %d: %u tiles, busy %.2f sec (avg tile %.3f sec, max tile %.3f sec) \n", tid, s.n_tiles,
+				s.total_time, s.n_tiles > 0 ? s.total_time/s.n_tiles : 0, s.max_time);
+		total_busy += s.total_time;
+	}
+	if(wall_time > 0 && thread_tile_stats.size() > 0) {
+		printf("Window hashing thread utilization: %.1f%% \n", 100*total_busy/(wall_time*thread_tile_stats.size()));
+	}
+}
+
+// distribution of the bucket sizes of the index (before dropping the hot buckets)
+// (size class c > 0 holds the buckets with [2^(c-1), 2^c) entries, class 0 the empty buckets)
+#define BUCKET_SIZE_CLASSES 34
+struct bucket_size_stats_t {
+	uint64 n_buckets[BUCKET_SIZE_CLASSES];
+	uint64 n_total;
+	uint64 n_entries;
+	uint64 max_size;
+	uint64 n_skipped; // hot buckets (see max_bucket_size)
+	uint64 n_skipped_entries;
+
+	bucket_size_stats_t() : n_total(0), n_entries(0), max_size(0), n_skipped(0), n_skipped_entries(0) {
+		memset(n_buckets, 0, sizeof(n_buckets));
+	}
+	void add(const uint64 size, const bool skipped) {
+		uint32 c = 0;
+		while(c < BUCKET_SIZE_CLASSES - 1 && (size >> c) > 0) c++;
+		n_buckets[c]++;
+		n_total++;
+		n_entries += size;
+		if(size > max_size) max_size = size;
+		if(skipped) {
+			n_skipped++;
+			n_skipped_entries += size;
+		}
+	}
+	void add(const bucket_size_stats_t& s) {
+		for(uint32 c = 0; c < BUCKET_SIZE_CLASSES; c++) {
+			n_buckets[c] += s.n_buckets[c];
+		}
+		n_total += s.n_total;
+		n_entries += s.n_entries;
+		max_size = std::max(max_size, s.max_size);
+		n_skipped += s.n_skipped;
+		n_skipped_entries += s.n_skipped_entries;
+	}
+};
+
+// (the entries of the hot buckets are either dropped or only marked as skipped)
+static void print_bucket_size_stats(const std::vector<bucket_size_stats_t>& table_stats, const bool dropped,
+		const index_params_t* params) {
+	bucket_size_stats_t s;
+	for(uint32 t = 0; t < table_stats.size(); t++) {
+		s.add(table_stats[t]);
+	}
+	if(s.n_total == 0) return;
+	const uint64 n_nonempty = s.n_total - s.n_buckets[0];
+	printf("Bucket sizes: %llu buckets, %.1f%% empty, mean %.2f entries (%.2f per non-empty bucket), max %llu \n",
+			s.n_total, 100.0*s.n_buckets[0]/s.n_total, (double) s.n_entries/s.n_total,
+			n_nonempty > 0 ? (double) s.n_entries/n_nonempty : 0, s.max_size);
+	for(uint32 c = 1; c < BUCKET_SIZE_CLASSES; c++) {
+		if(s.n_buckets[c] == 0) continue;
+		printf("  [%llu, %llu]: %llu buckets (%.2f%%) \n", 1ULL << (c - 1), (1ULL << c) - 1,
+				s.n_buckets[c], 100.0*s.n_buckets[c]/s.n_total);
+	}
+	if(params->max_bucket_size > 0) {
+		printf("Hot buckets (over %u entries): %llu skipped, %.2f%% of the entries %s \n", params->max_bucket_size,
+				s.n_skipped, s.n_entries > 0 ? 100.0*s.n_skipped_entries/s.n_entries : 0, dropped ? "dropped" : "marked");
+	}
+}
+
+// sorted run spilled to disk by the external-memory builder
+struct idx_run_t {
+	std::string fname;
+	std::vector<uint64> table_counts;	// number of entries of each table
+};
+static uint64 spill_ref_idx_run(const char* fastaFname, const int tid, std::vector<VectorSeqPos>& table_entries,
+		const bool keep_last, std::vector<idx_run_t>& runs, const index_params_t* params);
+static void merge_ref_idx_runs(const char* fastaFname, const std::vector<std::vector<idx_run_t> >& thread_runs,
+		const seq_t ref_len, const index_params_t* params);
+static void build_index_ref_lsh(const char* fastaFname, const seq_t first_window, const static_index_t* base,
+		index_params_t* params, ref_t& ref);
+static uint32 select_n_buckets_pow2(const ref_t& ref, const index_params_t* params);
+static void mark_window_block(ref_t& ref, const index_params_t* params, const seq_t start, const seq_t end, const char* bases);
 
 void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
 	// 1. load the reference
@@ -30,36 +139,270 @@ void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
 	fasta2ref(fastaFname, ref);
 	printf("Reference loading time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 
-	// 2. load the frequency of each kmer and collect high-frequency kmers
-	printf("Loading frequent kmers... \n");
+	// 2. load the frequency of each kmer and collect high-frequency kmers (counted first if there is no histogram for this -H and -k)
 	double start_time = omp_get_wtime();
-	load_freq_kmers(fastaFname, ref.high_freq_kmer_bitmap, ref.high_freq_kmer_trie, params->max_count);
-	mark_freq_kmers(ref, params);
+	if(kmer_hist_needs_count(fastaFname, params)) { // no histogram or counted for a larger -H or another -k
+		printf("Counting reference kmers... \n");
+		compute_store_kmer_hist(fastaFname, ref, params);
+	}
+	printf("Loading frequent kmers... \n");
+	load_freq_kmers(fastaFname, ref.high_freq_kmers, ref.high_freq_kmer_trie, params->max_count, params->k);
+	mark_freq_kmers(ref, params, 0);
 
 	printf("Loading valid windows mask... \n");
 	if(!load_valid_window_mask(fastaFname, ref, params)) {
-		mark_windows_to_discard(ref, params);
+		mark_windows_to_discard(ref, params, 0);
 		store_valid_window_mask(fastaFname, ref, params);
 	}
 	printf("Total window/kmer pre-processing time: %.2f sec\n", omp_get_wtime() - start_time);
 
-	// initialize the hash tables
-	ref.mutable_index.per_table_buckets.resize(params->n_tables);
-	for(uint32 t = 0; t < params->n_tables; t++) {
-		buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-		// initialize global buckets
-		buckets->buckets_data_vectors.resize(params->n_buckets);
-		// initialize per thread buckets
-		buckets->per_thread_buckets_data_vectors.resize(params->n_threads);
-		buckets->per_thread_bucket_sizes.resize(params->n_threads);
-		for(uint32 tid = 0; tid < params->n_threads; tid++) {
-			buckets->per_thread_buckets_data_vectors[tid].resize(params->n_buckets);
-			buckets->per_thread_bucket_sizes[tid].resize(params->n_buckets, 0);
+	if(params->auto_n_buckets) {
+		params->set_n_buckets(select_n_buckets_pow2(ref, params));
+	}
+	build_index_ref_lsh(fastaFname, 0, NULL, params, ref);
+}
+
+// computes and stores all the reference artifacts used by index and align from a single load of the reference:
+// the kmer histogram, the valid window mask, the kmer2 hashes and the kmer2 repeat info
+// (the histogram, the window mask and the kmer2 hashes are computed in one parallel pass over the unpacked blocks
+// of the reference, the repeats need all the kmer2 hashes and are computed afterwards)
+void prep_ref(const char* fastaFname, index_params_t* params) {
+	const double start_time = omp_get_wtime();
+	double stage_times[3];
+	double t = omp_get_wtime();
+	printf("Loading FASTA file %s... \n", fastaFname);
+	ref_t ref;
+	fasta2ref(fastaFname, ref);
+	stage_times[0] = omp_get_wtime() - t;
+
+	t = omp_get_wtime();
+	printf("Counting reference kmers, computing the valid windows mask and the kmer2 hashes... \n");
+	const seq_t n_windows = ref.len - params->ref_window_size + 1;
+	const seq_t n_kmer2 = ref.len - params->k2 + 1;
+	ref.ignore_window_bitmask.resize(n_windows);
+	ref.precomputed_kmer2_hashes.resize(n_kmer2);
+	compute_store_kmer_hist(fastaFname, ref, params, std::max(params->ref_window_size, params->k2),
+		[&](const seq_t block_start, const char* bases, const seq_t n_bases) {
+			if(block_start < n_windows) {
+				mark_window_block(ref, params, block_start, std::min((uint64) n_windows, (uint64) block_start + REF_BLOCK_SIZE), bases);
+			}
+			if(block_start < n_kmer2) {
+				hash_kmer2_bases(params, bases, std::min((uint64) n_kmer2 - block_start, (uint64) REF_BLOCK_SIZE),
+						&ref.precomputed_kmer2_hashes[block_start]);
+			}
+		});
+	store_valid_window_mask(fastaFname, ref, params);
+	store_kmer2_hashes(fastaFname, ref, params);
+	stage_times[1] = omp_get_wtime() - t;
+
+	t = omp_get_wtime();
+	printf("Computing kmer2 repeats... \n");
+	compute_store_repeat_info(fastaFname, ref, params);
+	stage_times[2] = omp_get_wtime() - t;
+
+	printf("Reference preparation time: %.2f sec (load %.2f, kmer histogram + window mask + kmer2 hashes %.2f, kmer2 repeats %.2f)\n",
+			omp_get_wtime() - start_time, stage_times[0], stage_times[1], stage_times[2]);
+}
+
+// packs the reference data of the current index configuration into <fastaFname>.bundle
+// (the missing kmer histogram, window mask, kmer2 hashes and repeats are computed; the flat index must exist)
+void bundle_ref(const char* fastaFname, index_params_t* params) {
+	const double start_time = omp_get_wtime();
+	printf("Loading FASTA file %s... \n", fastaFname);
+	ref_t ref;
+	fasta2ref(fastaFname, ref);
+	if(kmer_hist_needs_count(fastaFname, params)) { // no histogram or counted for a larger -H or another -k
+		printf("Counting reference kmers... \n");
+		compute_store_kmer_hist(fastaFname, ref, params);
+	}
+	load_freq_kmers(fastaFname, ref.high_freq_kmers, ref.high_freq_kmer_trie, params->max_count, params->k);
+	if(!load_valid_window_mask(fastaFname, ref, params)) {
+		mark_windows_to_discard(ref, params, 0);
+		store_valid_window_mask(fastaFname, ref, params);
+	}
+	if(!load_kmer2_hashes(fastaFname, ref, params)) {
+		printf("Computing kmer2 hashes... \n");
+		compute_store_kmer2_hashes(fastaFname, ref, params);
+	}
+	if(!load_repeat_info(fastaFname, ref, params)) {
+		printf("Computing kmer2 repeats... \n");
+		compute_store_repeat_info(fastaFname, ref, params);
+	}
+	if(!load_ref_idx_flat(fastaFname, ref, params)) {
+		printf("bundle_ref: No flat index found for %s (please build the index first)!\n", fastaFname);
+		exit(1);
+	}
+	store_ref_bundle(fastaFname, ref, params);
+	printf("Reference bundling time: %.2f sec\n", omp_get_wtime() - start_time);
+}
+
+// the smallest bucket exponent for which the sampled valid windows are at most bucket_load per bucket
+// (bounded so that the bucket ids of all the tables fit in 32 bits)
+static uint32 select_n_buckets_pow2(const ref_t& ref, const index_params_t* params) {
+	const seq_t n_windows = ref.len - params->ref_window_size + 1;
+	uint64 n_valid_windows = 0;
+	for(seq_t pos = 0; pos < n_windows; pos += params->ref_window_stride) {
+		if(!ref.ignore_window_bitmask[pos]) {
+			n_valid_windows++;
 		}
 	}
+	uint32 n_buckets_pow2 = MIN_N_BUCKETS_POW2;
+	while(n_buckets_pow2 < MAX_N_BUCKETS_POW2 && ((uint64) params->n_tables << (n_buckets_pow2 + 1)) <= UINT32_MAX
+			&& (n_valid_windows >> n_buckets_pow2) >= params->bucket_load) {
+		n_buckets_pow2++;
+	}
+	printf("Buckets per table: 2^%u (%llu valid windows, target load %u windows per bucket) \n",
+			n_buckets_pow2, n_valid_windows, params->bucket_load);
+	return n_buckets_pow2;
+}
+
+// sets the bucket exponent recorded in the flat index of fastaFname (-p 0)
+// or in its bundle first if use_bundle is set (the bundle may be older than the flat index)
+void load_index_n_buckets(const char* fastaFname, index_params_t* params, const bool use_bundle) {
+	uint32 n_buckets_pow2 = use_bundle ? load_ref_bundle_buckets_pow2(fastaFname) : 0;
+	if(n_buckets_pow2 == 0) {
+		n_buckets_pow2 = load_ref_idx_flat_buckets_pow2(fastaFname, params);
+	}
+	if(n_buckets_pow2 == 0) {
+		printf("load_index_n_buckets: No index found for %s (please build the index first)!\n", fastaFname);
+		exit(1);
+	}
+	params->set_n_buckets(n_buckets_pow2);
+	printf("Buckets per table: 2^%u \n", n_buckets_pow2);
+}
+
+// whether the bases [pos1, pos1 + n) and [pos2, pos2 + n) of the reference are equal
+static bool ref_bases_equal(const ref_t& ref, const seq_t pos1, const seq_t pos2, const seq_t n) {
+	std::vector<char> bases1(REF_BLOCK_SIZE);
+	std::vector<char> bases2(REF_BLOCK_SIZE);
+	for(seq_t i = 0; i < n; i += REF_BLOCK_SIZE) {
+		const seq_t n_bases = std::min((uint64) n - i, (uint64) REF_BLOCK_SIZE);
+		ref.seq.unpack(pos1 + i, n_bases, bases1.data());
+		ref.seq.unpack(pos2 + i, n_bases, bases2.data());
+		if(memcmp(bases1.data(), bases2.data(), n_bases) != 0) return false;
+	}
+	return true;
+}
+
+// moves a file written under the temporary reference name tmpFname to the same name under fastaFname
+static void rename_appended_file(const std::string& tmpFname, const std::string& fastaFname, const std::string& fname) {
+	const std::string final_fname = fastaFname + fname.substr(tmpFname.size());
+	if(rename(fname.c_str(), final_fname.c_str()) != 0) {
+		printf("append_index_ref_lsh: Cannot rename %s to %s!\n", fname.c_str(), final_fname.c_str());
+		exit(1);
+	}
+}
+
+// extends the index of fastaFname with the sequences of extraFname:
+// only the new windows (including the windows spanning the old/new boundary) are hashed and
+// merged with the existing buckets; the window mask and the kmer2 hash/repeat files (if present)
+// are extended accordingly and the new records are appended to fastaFname
+// all the files are first written under the temporary name <fastaFname>.append and renamed into place
+// once complete (the FASTA file before the index, so an interrupted rename is detected by the index length check)
+void append_index_ref_lsh(const char* fastaFname, const char* extraFname, index_params_t* params, ref_t& ref) {
+	const std::string tmpFname = std::string(fastaFname) + std::string(".append");
+
+	// 1. load the indexed reference and its existing index
+	printf("Loading FASTA file %s... \n", fastaFname);
+	clock_t t = clock();
+	fasta2ref(fastaFname, ref);
+	printf("Reference loading time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+	const seq_t old_len = ref.len;
+	if(old_len < params->ref_window_size || old_len < params->k2) {
+		printf("append_index_ref_lsh: Reference %s is shorter than the window size!\n", fastaFname);
+		exit(1);
+	}
+
+	printf("Loading the reference index for reference file %s... \n", fastaFname);
+	if(params->auto_n_buckets) {
+		load_index_n_buckets(fastaFname, params, false);
+	}
+	if(!load_ref_idx_flat(fastaFname, ref, params)) {
+		load_ref_idx(fastaFname, ref, params);
+	}
+	if(ref.index.ref_len != 0 && ref.index.ref_len != old_len) {
+		printf("append_index_ref_lsh: The index of %s was built for a reference of length %llu (current: %u), please rebuild it!\n",
+				fastaFname, ref.index.ref_len, old_len);
+		exit(1);
+	}
+	static_index_t base;
+	std::swap(base, ref.index);
+	const bool have_mask = load_valid_window_mask(fastaFname, ref, params);
+	const bool have_kmer2 = load_kmer2_hashes(fastaFname, ref, params);
+	const bool have_rep = have_kmer2 && load_repeat_info(fastaFname, ref, params);
+
+	// 2. append the new sequences
+	printf("Loading FASTA file %s... \n", extraFname);
+	t = clock();
+	fasta2ref(extraFname, ref);
+	printf("Reference loading time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+	const seq_t first_window = old_len - params->ref_window_size + 1;
+	const seq_t extra_len = ref.len - old_len;
+	if(extra_len <= old_len && ref_bases_equal(ref, old_len - extra_len, old_len, extra_len)) {
+		printf("append_index_ref_lsh: Reference %s already ends with the sequences of %s!\n", fastaFname, extraFname);
+		exit(1);
+	}
+
+	// 3. mark the new kmers/windows (the kmer frequencies of the original reference are kept)
+	printf("Loading frequent kmers... \n");
+	double start_time = omp_get_wtime();
+	load_freq_kmers(fastaFname, ref.high_freq_kmers, ref.high_freq_kmer_trie, params->max_count, params->k);
+	mark_freq_kmers(ref, params, first_window);
+	mark_windows_to_discard(ref, params, have_mask ? first_window : 0);
+	store_valid_window_mask(tmpFname.c_str(), ref, params);
+	printf("Total window/kmer pre-processing time: %.2f sec\n", omp_get_wtime() - start_time);
+
+	// 4. hash the new windows and merge them with the existing buckets
+	build_index_ref_lsh(fastaFname, first_window, &base, params, ref);
+	base.release();
+	printf("Storing the reference index for reference file %s... \n", fastaFname);
+	t = clock();
+	store_ref_idx_flat(tmpFname.c_str(), ref, params);
+	printf("Reference index storing time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+
+	// 5. extend the precomputed kmer2 hashes and repeats
+	if(have_kmer2) {
+		printf("Extending kmer2 hashes... \n");
+		compute_kmer2_hashes(ref, params, old_len - params->k2 + 1);
+		store_kmer2_hashes(tmpFname.c_str(), ref, params);
+	}
+	if(have_rep) {
+		printf("Extending repeat info... \n");
+		const seq_t first_kmer2 = old_len - params->k2 + 1;
+		compute_repeat_info(ref, params, first_kmer2 > MAX_LOC_LEN ? first_kmer2 - MAX_LOC_LEN : 0);
+		store_repeat_info(tmpFname.c_str(), ref, params);
+	}
+
+	// 6. append the new records to the reference file
+	append_fasta(fastaFname, extraFname, tmpFname.c_str());
+
+	// 7. move the new files into place
+	rename_appended_file(tmpFname, fastaFname, get_window_mask_fname(tmpFname.c_str(), params));
+	if(have_kmer2) {
+		rename_appended_file(tmpFname, fastaFname, get_kmer2_hashes_fname(tmpFname.c_str(), params));
+	}
+	if(have_rep) {
+		rename_appended_file(tmpFname, fastaFname, get_repeat_info_fname(tmpFname.c_str(), params));
+	}
+	rename_appended_file(tmpFname, fastaFname, tmpFname);
+	rename_appended_file(tmpFname, fastaFname, get_ref_idx_fname(tmpFname.c_str(), "idx_flat", params));
+	printf("Appended %s to %s (reference length %u -> %u)\n", extraFname, fastaFname, old_len, ref.len);
+}
+
+// hashes the reference windows starting at first_window and builds the static index
+// the entries of the base index (if any) are merged into the new buckets
+static void build_index_ref_lsh(const char* fastaFname, const seq_t first_window, const static_index_t* base,
+		index_params_t* params, ref_t& ref) {
+	// initialize the per-thread bucket entries
+	// each thread appends its entries to a flat buffer per table (in window order),
+	// the bucket id of an entry is given by the top bits of its projection hash
+	std::vector<std::vector<VectorSeqPos> > thread_entries(params->n_threads);
+	for(uint32 tid = 0; tid < params->n_threads; tid++) {
+		thread_entries[tid].resize(params->n_tables);
+	}
 
 	// initialize additional per-thread storage
-	std::vector<minhash_matrix_t> minhash_matrices(params->n_threads);
+	std::vector<minhash_rolling_t> minhash_rolling_states(params->n_threads);
 	std::vector<VectorMinHash> minhash_thread_vectors(params->n_threads);
 	for(uint32 i = 0; i < params->n_threads; i++) {
 		minhash_thread_vectors[i].resize(params->h);
@@ -73,212 +416,717 @@ void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
 	uint64 n_bucket_entries = 0;
 	uint64 n_filtered = 0;
 
-#if EXTERNAL_MEM_INDEX
-#define MAX_NTABLES_NO_DISK 1024
-	int file_nsync_points = 0;
-	if(params->n_tables > MAX_NTABLES_NO_DISK) {
-		file_nsync_points = 42*params->n_tables/128;
+	// external-memory construction: when the entries of a thread exceed its share of the memory budget,
+	// they are sorted and spilled to disk as a run, the runs are merged into the index file at the end
+	const bool external_mem = params->mem_budget > 0 && base == NULL;
+	const uint64 max_thread_entries = external_mem ? std::max((uint64) 1, params->mem_budget/(params->n_threads*sizeof(loc_t))) : 0;
+	std::vector<std::vector<idx_run_t> > thread_runs(params->n_threads);
+	if(external_mem) {
+		printf("External-memory index construction: budget %.2f MB (%llu entries per thread) \n",
+				(double) params->mem_budget/(1 << 20), max_thread_entries);
 	}
-	VectorU32 nsync_per_thread(params->n_threads);
-#endif
 
-	start_time = omp_get_wtime();
+	// windows are split into fixed-size tiles scheduled dynamically across the threads
+	// (the rolling min-hash restarts at most once per tile)
+	const seq_t n_windows = ref.len - params->ref_window_size + 1;
+	const uint64 first_tile = first_window / REF_TILE_SIZE;
+	const uint64 n_tiles = (n_windows + REF_TILE_SIZE - 1) / REF_TILE_SIZE;
+	std::vector<tile_stats_t> thread_tile_stats(params->n_threads);
+
+	double start_time = omp_get_wtime();
 	omp_set_num_threads(params->n_threads); // split the windows across the threads
 	#pragma omp parallel reduction(+:n_valid_windows, n_valid_hashes, n_bucket_entries, n_filtered)
 	{
 	    int tid = omp_get_thread_num();
-	    int n_threads = omp_get_num_threads();
-	    seq_t chunk_start = ((ref.len - params->ref_window_size + 1) / n_threads)*tid;
-	    seq_t chunk_end = ((ref.len - params->ref_window_size + 1) / n_threads)*(tid + 1);
-	    printf("Thread %d range: %u %u \n", tid, chunk_start, chunk_end);
+	    std::vector<VectorSeqPos>& table_entries = thread_entries[tid];
+	    tile_stats_t& tile_stats = thread_tile_stats[tid];
+	    uint64 n_thread_entries = 0;
+	    uint64 n_thread_windows = 0;
+	    minhash_rolling_t& rolling_minhash = minhash_rolling_states[tid];
+	    rolling_minhash.init(params->ref_window_size, params);
+	    kmer_hash_stream_t kmer_hashes;
+	    kmer_hashes.start = kmer_hashes.end = 0;
+	    const seq_t n_window_kmers = params->ref_window_size - params->k + 1;
+	    const seq_t stride = params->ref_window_stride;
+	    #pragma omp for schedule(dynamic, 1) nowait
+	    for(uint64 tile = first_tile; tile < n_tiles; tile++) {
+	    	const seq_t tile_start = std::max((uint64) first_window, tile*REF_TILE_SIZE);
+	    	const seq_t tile_end = std::min((uint64) n_windows, (tile + 1)*REF_TILE_SIZE);
+	    	const double tile_start_time = omp_get_wtime();
+	    	const seq_t first_pos = (tile_start + stride - 1)/stride*stride;
+	    	for (seq_t pos = first_pos; pos < tile_end; pos += stride) { // for each sampled window of the tile
+	    		if(external_mem && n_thread_entries >= max_thread_entries) {
+	    			n_thread_entries = spill_ref_idx_run(fastaFname, tid, table_entries, true, thread_runs[tid], params);
+	    		}
+	    		// discard windows with low information content
+	    		if(ref.ignore_window_bitmask[pos]) {
+	    			continue;
+	    		}
+	    		n_valid_windows++;
 
-#if EXTERNAL_MEM_INDEX
-	    int sync_point = 1;
-#endif
-	    bool init_minhash = true;
-	    for (seq_t pos = chunk_start; pos != chunk_end; pos++) { // for each window of the thread's chunk
-	    	if((pos - chunk_start) % REPORT_WINDOW_PROC_GRANULARITY == 0 && (pos - chunk_start) != 0) {
-				printf("Thread %d processed %u valid windows \n", tid, pos - chunk_start);
-			}
-#if EXTERNAL_MEM_INDEX
-	    	// check if we should write to file
-	    	if(file_nsync_points > 0) {
-	    		int sync_chunk_size = (chunk_end - chunk_start + 1)/(file_nsync_points + 1);
-	    		if(n_valid_windows == (uint32)sync_chunk_size*sync_point) {
-	    			printf("Thread %d sync point: %u, n_valid_windows: %u \n", tid, pos, n_valid_windows);
-	    			store_ref_idx_per_thread(tid, sync_point == 1, fastaFname, ref, params);
-	    			sync_point++;
-	    			nsync_per_thread[tid]++;
+	    		// hash the kmers of the next range of windows
+	    		if(pos < kmer_hashes.start || pos + n_window_kmers > kmer_hashes.end) {
+	    			const seq_t stream_end = std::min(tile_end, pos + KMER_HASH_STREAM_CHUNK) + n_window_kmers - 1;
+	    			kmer_hashes.compute(ref.seq, ref.ignore_kmer_bitmask, pos, stream_end, params);
 	    		}
-	    	}
-#endif
-	    	// discard windows with low information content
-	    	if(ref.ignore_window_bitmask[pos]) {
-	    		init_minhash = true;
-	    		continue;
-			}
-	    	n_valid_windows++;
-
-	    	// get the min-hash signature for the window
-	    	VectorMinHash& minhashes = minhash_thread_vectors[tid]; // each thread indexes into its pre-allocated buffer
-	    	minhash_matrix_t& rolling_minhash_matrix = minhash_matrices[tid];
-	    	bool valid_hash;
-	    	if(init_minhash == true) {
-	    		valid_hash = minhash_rolling_init(ref.seq.c_str(), pos, params->ref_window_size,
-	    					rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
-							minhashes);
-	    		init_minhash = false;
-	    	} else {
-	    		valid_hash = minhash_rolling(ref.seq.c_str(), pos, params->ref_window_size,
-	    					rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
-							minhashes);
-	    	}
 
-	    	if(!valid_hash) {
-	    		continue;
-	    	}
-	    	n_valid_hashes++;
-
-	    	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
-	    		minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(
-	    				minhashes, params->sketch_proj_indices, t*params->sketch_proj_len);
-	    		minhash_t bucket_hash = params->sketch_proj_hash_func.bucket_hash(proj_hash);
-	    		
-			buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-	    		VectorSeqPos& bucket = buckets->per_thread_buckets_data_vectors[tid][bucket_hash];
-	    		if(bucket.size() == 0) { // first item in this thread bucket
-	    			bucket.resize(params->bucket_size);
+	    		// get the min-hash signature for the window
+	    		VectorMinHash& minhashes = minhash_thread_vectors[tid]; // each thread indexes into its pre-allocated buffer
+	    		bool valid_hash = rolling_minhash.window_minhash(kmer_hashes, pos, minhashes);
+
+	    		if(!valid_hash) {
+	    			continue;
 	    		}
-	    		// add to the bucket
-	    		uint32 curr_size = buckets->per_thread_bucket_sizes[tid][bucket_hash];
-	    		if(curr_size + 1 >= bucket.size()) {
-	    			bucket.resize(curr_size + 100);
+	    		n_valid_hashes++;
+
+	    		for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
+	    			minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(
+	    					minhashes, params->sketch_proj_indices, t*params->sketch_proj_len);
+	    			minhash_t bucket_hash = params->sketch_proj_hash_func.bucket_hash(proj_hash);
+
+	    			// extend the last entry if the previous window was stored in the same bucket
+	    			// (the last entry of the table is the only one that can end at this window,
+	    			// entries are not extended across tiles to keep the index independent of the schedule)
+	    			// a sampled window covers the positions up to the next sampled window
+	    			VectorSeqPos& entries = table_entries[t];
+	    			if(entries.size() > 0) {
+	    				loc_t& epos = entries.back();
+	    				if(epos.len < MAX_LOC_LEN - stride && (epos.pos + epos.len) == pos && epos.pos >= tile_start &&
+	    						params->sketch_proj_hash_func.bucket_hash(epos.hash) == bucket_hash) {
+	    					epos.len += stride;
+	    					n_filtered++;
+	    					continue;
+	    				}
+	    			}
+	    			loc_t new_loc;
+	    			new_loc.pos = pos;
+	    			new_loc.len = stride;
+	    			new_loc.hash = proj_hash;
+	    			entries.push_back(new_loc);
+	    			n_bucket_entries++;
+	    			n_thread_entries++;
 	    		}
-				bool store_pos = true;
-				if(curr_size > 0) {
-					loc_t* epos = &bucket[curr_size-1];
-					if(epos->len < MAX_LOC_LEN && (epos->pos + epos->len) == pos) {
-						epos->len++;
-						store_pos = false;
-					} /*else if((epos->pos + epos->len) + params->bucket_entry_coverage >= pos) { // sampling
-						epos->len += pos - (epos->pos + epos->len - 1);
-						store_pos = false;
-					}*/
-				}
-				if(store_pos) {
-					loc_t new_loc;
-					new_loc.pos = pos;
-					new_loc.len = 1;
-					new_loc.hash = proj_hash;
-					bucket[curr_size] = new_loc;
-					buckets->per_thread_bucket_sizes[tid][bucket_hash]++;
-					n_bucket_entries++;
-				} else {
-					n_filtered++;
-				}
 	    	}
+	    	tile_stats.add_tile(omp_get_wtime() - tile_start_time);
+	    	n_thread_windows += tile_end - tile_start;
+	    	if(n_thread_windows / REPORT_WINDOW_PROC_GRANULARITY != (n_thread_windows - (tile_end - tile_start)) / REPORT_WINDOW_PROC_GRANULARITY) {
+	    		printf("Thread %d processed %llu windows \n", tid, n_thread_windows);
+	    	}
+	    }
+	    if(external_mem) {
+	    	spill_ref_idx_run(fastaFname, tid, table_entries, false, thread_runs[tid], params);
 	    }
 	}
+	print_tile_stats(thread_tile_stats, omp_get_wtime() - start_time);
 	printf("Populated all the buckets. Time : %.2f sec\n", omp_get_wtime() - start_time);
 
-	// 4. collect per thread results
-	printf("Collecting thread buckets... \n");
-	double start_coll_sort = omp_get_wtime();
-	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
-		buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-		buckets->n_entries = 0;
+	printf("Total number of valid reference windows: %u \n", n_valid_windows);
+	printf("Total number of valid reference windows with valid hashes: %u \n", n_valid_hashes);
+	printf("Total number of window bucket entries: %llu \n", n_bucket_entries);
+	printf("Total number of window bucket entries filtered: %llu \n", n_filtered);
+
+	if(external_mem) { // the index file is written directly
+		merge_ref_idx_runs(fastaFname, thread_runs, ref.len, params);
+		printf("Total hashing time: %.2f sec\n", omp_get_wtime() - start_time);
+		return;
+	}
+
+	// 4. count the entries of each bucket and fill the static index
+	// (the entries of the hot buckets are dropped, the buckets of the base index stay skipped)
+	printf("Filling the index buckets... \n");
+	double start_fill = omp_get_wtime();
+	ref.index.bucket_offsets.resize(params->n_tables*params->n_buckets + 1);
+	std::vector<uint64> table_offsets(params->n_tables + 1);
+	std::vector<bucket_size_stats_t> table_stats(params->n_tables);
+	#pragma omp parallel for schedule(dynamic)
+	for(uint32 t = 0; t < params->n_tables; t++) { // count the entries of each bucket of the table
+		uint64* counts = &ref.index.bucket_offsets[t*params->n_buckets];
+		if(base != NULL) {
+			for(uint32 b = 0; b < params->n_buckets; b++) {
+				counts[b] = base->bucket_size(t*params->n_buckets + b);
+			}
+		}
+		for(uint32 tid = 0; tid < params->n_threads; tid++) {
+			const VectorSeqPos& entries = thread_entries[tid][t];
+			for(uint64 i = 0; i < entries.size(); i++) {
+				counts[params->sketch_proj_hash_func.bucket_hash(entries[i].hash)]++;
+			}
+		}
 		for(uint32 b = 0; b < params->n_buckets; b++) {
-			for(uint32 tid = 0; tid < params->n_threads; tid++) {
-				VectorSeqPos& global_bucket = buckets->buckets_data_vectors[b];
-				VectorSeqPos& thread_bucket = buckets->per_thread_buckets_data_vectors[tid][b];
-				global_bucket.insert(global_bucket.end(), thread_bucket.begin(), thread_bucket.begin() + buckets->per_thread_bucket_sizes[tid][b]);
-				VectorSeqPos().swap(buckets->per_thread_buckets_data_vectors[tid][b]);
-				buckets->n_entries += buckets->per_thread_bucket_sizes[tid][b];
+			const bool skip = params->hot_bucket(counts[b]) ||
+					(base != NULL && base->bucket_skipped(t*params->n_buckets + b));
+			table_stats[t].add(counts[b], skip);
+			if(skip) {
+				counts[b] |= BUCKET_SKIP_FLAG;
+			} else {
+				table_offsets[t+1] += counts[b];
 			}
 		}
-		std::vector<VectorU32>().swap(buckets->per_thread_bucket_sizes);
-		std::vector<std::vector<VectorSeqPos>>().swap(buckets->per_thread_buckets_data_vectors);
 	}
-	printf("Collected all the buckets. Time : %.2f sec\n", omp_get_wtime() - start_coll_sort);
-
-#if EXTERNAL_MEM_INDEX
-	if(file_nsync_points > 0) { // read partial files from disk
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		table_offsets[t+1] += table_offsets[t];
+	}
+	ref.index.buckets_data.resize(table_offsets[params->n_tables]);
+	#pragma omp parallel for schedule(dynamic)
+	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
+		uint64* offsets = &ref.index.bucket_offsets[t*params->n_buckets];
+		std::vector<uint64> counts(params->n_buckets);
+		// bucket offsets: prefix sum of the counts
+		uint64 offset = table_offsets[t];
+		for(uint32 b = 0; b < params->n_buckets; b++) {
+			const uint64 count = offsets[b];
+			offsets[b] = offset | (count & BUCKET_SKIP_FLAG);
+			counts[b] = offset; // next free slot in the bucket
+			if(!(count & BUCKET_SKIP_FLAG)) {
+				offset += count;
+			}
+		}
+		if(base != NULL) { // the base entries come first
+			for(uint32 b = 0; b < params->n_buckets; b++) {
+				const uint64 bid = t*params->n_buckets + b;
+				if(offsets[b] & BUCKET_SKIP_FLAG) continue;
+				for(uint64 i = base->bucket_start(bid); i < base->bucket_start(bid + 1); i++) {
+					base->get_entry(bid, i, ref.index.buckets_data[counts[b]]);
+					counts[b]++;
+				}
+			}
+		}
+		// fill (the tiles are scheduled dynamically, the buckets are sorted below)
 		for(uint32 tid = 0; tid < params->n_threads; tid++) {
-			load_ref_idx_per_thread(tid, nsync_per_thread[tid], fastaFname, ref, params);
+			VectorSeqPos& entries = thread_entries[tid][t];
+			for(uint64 i = 0; i < entries.size(); i++) {
+				const uint32 b = params->sketch_proj_hash_func.bucket_hash(entries[i].hash);
+				if(offsets[b] & BUCKET_SKIP_FLAG) continue;
+				ref.index.buckets_data[counts[b]] = entries[i];
+				counts[b]++;
+			}
+			VectorSeqPos().swap(entries);
 		}
 	}
-#endif
+	ref.index.bucket_offsets[params->n_tables*params->n_buckets] = table_offsets[params->n_tables];
+	printf("Filled all the buckets. Time : %.2f sec\n", omp_get_wtime() - start_fill);
 
 	// 5. sort each bucket!
 	printf("Sorting buckets... \n");
-	double start_time_sort = omp_get_wtime();
-	#pragma omp parallel for
-	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
-		buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
+	sort_index_buckets(ref.index, params);
+	ref.index.build_bucket_directory(params->n_buckets_pow2);
+	ref.index.set_views();
+	if(params->idx_entry_encoding == ENTRY_PACKED) {
+		pack_index_entries(ref.index, params);
+	}
+	printf("Index entries: %llu, %.2f bytes/entry \n", ref.index.n_entries,
+			ref.index.n_entries > 0 ? (double) ref.index.entries_bytes()/ref.index.n_entries : 0);
+	print_bucket_size_stats(table_stats, true, params);
+	printf("Total hashing time: %.2f sec\n", omp_get_wtime() - start_time);
+}
+
+// --- Bucket sorting ---
+
+#define RADIX_SORT_MIN_SIZE 64
+#define RADIX_BITS 8
+#define RADIX_N_BINS (1 << RADIX_BITS)
+#define RADIX_N_DIGITS 8
+
+// bucket entries are ordered by (hash, pos)
+static inline uint64 loc_sort_key(const loc_t& l) {
+	return ((uint64) l.hash << 32) | l.pos;
+}
+
+// sorts the entries by (hash, pos) using LSD radix sort on the 64-bit key
+// digits that are identical across all the entries are skipped (e.g. the bucket id bits of the hash)
+// small inputs are insertion sorted
+void sort_bucket_entries(loc_t* entries, const uint64 n, std::vector<loc_t>& buffer) {
+	if(n < RADIX_SORT_MIN_SIZE) {
+		for(uint64 i = 1; i < n; i++) {
+			const loc_t tmp = entries[i];
+			const uint64 key = loc_sort_key(tmp);
+			uint64 j = i;
+			while(j > 0 && loc_sort_key(entries[j-1]) > key) {
+				entries[j] = entries[j-1];
+				j--;
+			}
+			entries[j] = tmp;
+		}
+		return;
+	}
+
+	// digit histograms (all the digits in one pass)
+	uint64 counts[RADIX_N_DIGITS][RADIX_N_BINS] = {{ 0 }};
+	for(uint64 i = 0; i < n; i++) {
+		const uint64 key = loc_sort_key(entries[i]);
+		for(int d = 0; d < RADIX_N_DIGITS; d++) {
+			counts[d][(key >> (d*RADIX_BITS)) & (RADIX_N_BINS - 1)]++;
+		}
+	}
+
+	if(buffer.size() < n) {
+		buffer.resize(n);
+	}
+	loc_t* src = entries;
+	loc_t* dst = &buffer[0];
+	for(int d = 0; d < RADIX_N_DIGITS; d++) {
+		const int shift = d*RADIX_BITS;
+		if(counts[d][(loc_sort_key(src[0]) >> shift) & (RADIX_N_BINS - 1)] == n) {
+			continue; // all the entries share this digit
+		}
+		uint64 offset = 0;
+		for(int b = 0; b < RADIX_N_BINS; b++) {
+			const uint64 c = counts[d][b];
+			counts[d][b] = offset;
+			offset += c;
+		}
+		for(uint64 i = 0; i < n; i++) {
+			const uint32 b = (loc_sort_key(src[i]) >> shift) & (RADIX_N_BINS - 1);
+			dst[counts[d][b]++] = src[i];
+		}
+		std::swap(src, dst);
+	}
+	if(src != entries) {
+		memcpy(entries, src, n*sizeof(loc_t));
+	}
+}
+
+// sorts the entries of each bucket across all the tables
+void sort_index_buckets(static_index_t& index, const index_params_t* params) {
+	double start_time = omp_get_wtime();
+	const uint64 n_buckets_total = (uint64) params->n_tables*params->n_buckets;
+	#pragma omp parallel
+	{
+		std::vector<loc_t> buffer;
+		#pragma omp for schedule(dynamic, 1024)
+		for(uint64 bid = 0; bid < n_buckets_total; bid++) {
+			const uint64 start = index.bucket_offsets[bid] & ~BUCKET_SKIP_FLAG;
+			const uint64 size = (index.bucket_offsets[bid + 1] & ~BUCKET_SKIP_FLAG) - start;
+			sort_bucket_entries(&index.buckets_data[start], size, buffer);
+		}
+	}
+	const double sort_time = omp_get_wtime() - start_time;
+	printf("Total sort time : %.2f sec (%llu entries, %.2f M entries/sec)\n", sort_time,
+			(uint64) index.buckets_data.size(), sort_time > 0 ? index.buckets_data.size()/sort_time/1e6 : 0);
+}
+
+// --- External-memory construction ---
+
+// sorts the entries of each table and stores them as a new run of the thread
+// keep_last: the last entry of each table stays in memory (it can still be extended by the next window)
+// returns the number of entries kept in memory
+static uint64 spill_ref_idx_run(const char* fastaFname, const int tid, std::vector<VectorSeqPos>& table_entries,
+		const bool keep_last, std::vector<idx_run_t>& runs, const index_params_t* params) {
+	std::vector<loc_t> last_entries(table_entries.size());
+	std::vector<char> kept(table_entries.size(), 0);
+	std::vector<loc_t> buffer;
+	for(uint32 t = 0; t < table_entries.size(); t++) {
+		VectorSeqPos& entries = table_entries[t];
+		if(keep_last && entries.size() > 0) {
+			last_entries[t] = entries.back();
+			kept[t] = 1;
+			entries.pop_back();
+		}
+		sort_bucket_entries(entries.data(), entries.size(), buffer);
+	}
+
+	idx_run_t run;
+	run.fname = std::string(fastaFname) + ".idx_run_t" + std::to_string(tid) + "_" + std::to_string(runs.size());
+	store_ref_idx_run(run.fname, table_entries, run.table_counts);
+	runs.push_back(run);
+
+	uint64 n_kept = 0;
+	for(uint32 t = 0; t < table_entries.size(); t++) {
+		table_entries[t].clear();
+		if(kept[t]) {
+			table_entries[t].push_back(last_entries[t]);
+			n_kept++;
+		}
+	}
+	return n_kept;
+}
+
+// smallest read buffer of a run (entries)
+#define MIN_RUN_BUF_ENTRIES (1 << 10)
+
+// k-way merge of the sorted runs of each table into the flat index file
+// tables are merged in parallel, each writes its bucket offsets and entries at their final position in the file
+static void merge_ref_idx_runs(const char* fastaFname, const std::vector<std::vector<idx_run_t> >& thread_runs,
+		const seq_t ref_len, const index_params_t* params) {
+	double start_time = omp_get_wtime();
+	std::vector<const idx_run_t*> runs;
+	for(uint32 tid = 0; tid < thread_runs.size(); tid++) {
+		for(uint32 i = 0; i < thread_runs[tid].size(); i++) {
+			runs.push_back(&thread_runs[tid][i]);
+		}
+	}
+	const uint32 n_runs = runs.size();
+
+	// entry offset of each table in the index and of each table section in the runs
+	std::vector<uint64> table_offsets(params->n_tables + 1);
+	std::vector<std::vector<uint64> > run_table_offsets(n_runs);
+	for(uint32 r = 0; r < n_runs; r++) {
+		run_table_offsets[r].resize(params->n_tables);
+		uint64 offset = params->n_tables*sizeof(uint64);
+		for(uint32 t = 0; t < params->n_tables; t++) {
+			run_table_offsets[r][t] = offset;
+			offset += runs[r]->table_counts[t]*sizeof(loc_t);
+		}
+	}
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		table_offsets[t+1] = table_offsets[t];
+		for(uint32 r = 0; r < n_runs; r++) {
+			table_offsets[t+1] += runs[r]->table_counts[t];
+		}
+	}
+	const uint64 n_entries = table_offsets[params->n_tables];
+
+	std::vector<int> run_fds(n_runs);
+	for(uint32 r = 0; r < n_runs; r++) {
+		run_fds[r] = open(runs[r]->fname.c_str(), O_RDONLY);
+		if(run_fds[r] < 0) {
+			printf("merge_ref_idx_runs: Cannot open the IDX run file %s!\n", runs[r]->fname.c_str());
+			exit(1);
+		}
+	}
+	idx_flat_header_t header;
+	init_ref_idx_flat_header(header, n_entries, 32, ref_len, params);
+	std::string fname = get_ref_idx_fname(fastaFname, "idx_flat", params);
+	int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		printf("merge_ref_idx_runs: Cannot open the IDX file %s!\n", fname.c_str());
+		exit(1);
+	}
+	write_file_at(fd, &header, sizeof(header), 0);
+
+	// the run readers, the output buffer and the bucket counts of each merging thread share the memory budget
+	// (fewer tables are merged in parallel if the smallest buffers of all the threads do not fit)
+	const uint64 counts_bytes = params->n_buckets*sizeof(uint64);
+	uint32 n_merge_threads = params->n_threads;
+	while(n_merge_threads > 1 && n_merge_threads*(MIN_RUN_BUF_ENTRIES*sizeof(loc_t)*(n_runs + 1) + counts_bytes) > params->mem_budget) {
+		n_merge_threads--;
+	}
+	const uint64 thread_budget = params->mem_budget/n_merge_threads;
+	const uint64 buf_entries = std::min((uint64) 1 << 20, std::max((uint64) MIN_RUN_BUF_ENTRIES,
+			((thread_budget > counts_bytes) ? thread_budget - counts_bytes : 0)/(sizeof(loc_t)*(n_runs + 1))));
+	const uint64 merge_bytes = n_merge_threads*(buf_entries*sizeof(loc_t)*(n_runs + 1) + counts_bytes);
+	printf("Merging %u sorted runs with %u thread(s): %.2f MB of buffers \n", n_runs, n_merge_threads, (double) merge_bytes/(1 << 20));
+	if(merge_bytes > params->mem_budget) {
+		printf("Note: the merge buffers of %u runs exceed the memory budget \n", n_runs);
+	}
+	std::vector<bucket_size_stats_t> table_stats(params->n_tables);
+	#pragma omp parallel for schedule(dynamic) num_threads(n_merge_threads)
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		typedef std::pair<uint64, uint32> heap_item_t; // (hash, pos) key, run
+		std::priority_queue<heap_item_t, std::vector<heap_item_t>, std::greater<heap_item_t> > heap;
+		std::vector<idx_run_reader_t> readers(n_runs);
+		std::vector<loc_t> heads(n_runs);
+		for(uint32 r = 0; r < n_runs; r++) {
+			readers[r].init(run_fds[r], run_table_offsets[r][t], runs[r]->table_counts[t], buf_entries);
+			if(readers[r].next(heads[r])) {
+				heap.push(heap_item_t(loc_sort_key(heads[r]), r));
+			}
+		}
+		std::vector<uint64> offsets(params->n_buckets);
+		std::vector<loc_t> out;
+		out.reserve(buf_entries);
+		uint64 out_pos = table_offsets[t];
+		while(!heap.empty()) {
+			const uint32 r = heap.top().second;
+			heap.pop();
+			out.push_back(heads[r]);
+			offsets[params->sketch_proj_hash_func.bucket_hash(heads[r].hash)]++;
+			if(out.size() == buf_entries) {
+				write_file_at(fd, out.data(), out.size()*sizeof(loc_t), header.entries_file_offset + out_pos*sizeof(loc_t));
+				out_pos += out.size();
+				out.clear();
+			}
+			if(readers[r].next(heads[r])) {
+				heap.push(heap_item_t(loc_sort_key(heads[r]), r));
+			}
+		}
+		write_file_at(fd, out.data(), out.size()*sizeof(loc_t), header.entries_file_offset + out_pos*sizeof(loc_t));
+
+		// bucket offsets: prefix sum of the counts
+		uint64 offset = table_offsets[t];
 		for(uint32 b = 0; b < params->n_buckets; b++) {
-			VectorSeqPos& bucket = buckets->buckets_data_vectors[b];
-			std::sort(bucket.begin(), bucket.end(), comp_loc());
+			const uint64 count = offsets[b];
+			const bool skip = params->hot_bucket(count);
+			offsets[b] = offset | (skip ? BUCKET_SKIP_FLAG : 0);
+			offset += count;
+			table_stats[t].add(count, skip);
 		}
+		store_bucket_directory(fd, header, t, offsets);
 	}
-	printf("Total sort time : %.2f sec\n", omp_get_wtime() - start_time_sort);
-	printf("Total number of valid reference windows: %u \n", n_valid_windows);
-	printf("Total number of valid reference windows with valid hashes: %u \n", n_valid_hashes);
-	printf("Total number of window bucket entries: %llu \n", n_bucket_entries);
-	printf("Total number of window bucket entries filtered: %llu \n", n_filtered);
-	printf("Total hashing time: %.2f sec\n", omp_get_wtime() - start_time);
+	if(ftruncate(fd, header.entries_file_offset + header.entries_bytes) != 0) {
+		printf("merge_ref_idx_runs: Cannot resize the IDX file %s!\n", fname.c_str());
+		exit(1);
+	}
+	close(fd);
+	print_bucket_size_stats(table_stats, false, params);
+
+	uint64 run_bytes = 0;
+	for(uint32 r = 0; r < n_runs; r++) {
+		close(run_fds[r]);
+		remove(runs[r]->fname.c_str());
+		run_bytes += params->n_tables*sizeof(uint64);
+		for(uint32 t = 0; t < params->n_tables; t++) {
+			run_bytes += runs[r]->table_counts[t]*sizeof(loc_t);
+		}
+	}
+	printf("Merged %u sorted runs (%.2f MB) into %s: %llu entries. Time : %.2f sec\n", n_runs,
+			(double) run_bytes/(1 << 20), fname.c_str(), n_entries, omp_get_wtime() - start_time);
 }
 
-void load_index_ref_lsh(const char* fastaFname, const index_params_t* params, ref_t& ref) {
+// --- Merging of partial indexes ---
+
+// merges the indexes built independently for consecutive parts of the reference fastaFname
+// (the concatenation of the part FASTA files, in the given order, must be the reference)
+// the positions of each part are rebased to the offset of its first subsequence in the reference
+// and the sorted buckets of the parts are k-way merged and streamed to the flat index of the reference
+// note: the windows spanning two parts are not indexed
+void merge_index_ref_lsh(const char* fastaFname, const std::vector<std::string>& partFnames, index_params_t* params) {
+	double start_time = omp_get_wtime();
 	printf("Loading FASTA file %s... \n", fastaFname);
-	clock_t t = clock();
+	ref_t ref;
 	fasta2ref(fastaFname, ref);
-	printf("Time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 
+	// 1. load the part indexes and find the position offset of each part
+	const uint32 n_parts = partFnames.size();
+	std::vector<static_index_t> parts(n_parts);
+	std::vector<seq_t> part_offsets(n_parts);
+	uint32 n_subseqs = 0;
+	for(uint32 p = 0; p < n_parts; p++) {
+		ref_t part;
+		fasta2ref(partFnames[p].c_str(), part);
+		if(n_subseqs + part.subsequence_offsets.size() > ref.subsequence_offsets.size()) {
+			printf("merge_index_ref_lsh: Part %s is not a subsequence range of %s!\n", partFnames[p].c_str(), fastaFname);
+			exit(1);
+		}
+		part_offsets[p] = ref.subsequence_offsets[n_subseqs];
+		n_subseqs += part.subsequence_offsets.size();
+		const seq_t part_end = (n_subseqs < ref.subsequence_offsets.size()) ? ref.subsequence_offsets[n_subseqs] : ref.len;
+		if(part_offsets[p] + part.len != part_end || !ref.seq.matches(part_offsets[p], part.seq)) {
+			printf("merge_index_ref_lsh: Part %s is not a subsequence range of %s!\n", partFnames[p].c_str(), fastaFname);
+			exit(1);
+		}
+		if(params->auto_n_buckets) { // the parts must record the same bucket exponent
+			const uint32 n_buckets_pow2 = load_ref_idx_flat_buckets_pow2(partFnames[p].c_str(), params);
+			if(n_buckets_pow2 == 0 || (p > 0 && n_buckets_pow2 != params->n_buckets_pow2)) {
+				printf("merge_index_ref_lsh: Part %s has no index with the bucket exponent of the other parts (index the parts with the same -p)!\n",
+						partFnames[p].c_str());
+				exit(1);
+			}
+			params->set_n_buckets(n_buckets_pow2);
+		}
+		if(!load_ref_idx_flat(partFnames[p].c_str(), part, params)) {
+			load_ref_idx(partFnames[p].c_str(), part, params);
+		}
+		std::swap(parts[p], part.index);
+	}
+	if(n_subseqs != ref.subsequence_offsets.size()) {
+		printf("merge_index_ref_lsh: The parts do not cover all the subsequences of %s!\n", fastaFname);
+		exit(1);
+	}
+
+	// 2. merge the buckets of each table (in parallel), rebasing the entry positions
+	std::vector<uint64> table_offsets(params->n_tables + 1);
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		table_offsets[t+1] = table_offsets[t];
+		for(uint32 p = 0; p < n_parts; p++) {
+			table_offsets[t+1] += parts[p].bucket_start((t + 1)*params->n_buckets) - parts[p].bucket_start(t*params->n_buckets);
+		}
+	}
+	const uint64 n_entries = table_offsets[params->n_tables];
+
+	idx_flat_header_t header;
+	init_ref_idx_flat_header(header, n_entries, 32, ref.len, params);
+	std::string fname = get_ref_idx_fname(fastaFname, "idx_flat", params);
+	int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		printf("merge_index_ref_lsh: Cannot open the IDX file %s!\n", fname.c_str());
+		exit(1);
+	}
+	write_file_at(fd, &header, sizeof(header), 0);
+
+	const uint64 buf_entries = 1 << 16;
+	std::vector<bucket_size_stats_t> table_stats(params->n_tables);
+	#pragma omp parallel for schedule(dynamic)
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		typedef std::pair<uint64, uint32> heap_item_t; // (hash, pos) key, part
+		std::priority_queue<heap_item_t, std::vector<heap_item_t>, std::greater<heap_item_t> > heap;
+		std::vector<uint64> next(n_parts);
+		std::vector<loc_t> heads(n_parts);
+		std::vector<uint64> offsets(params->n_buckets);
+		std::vector<loc_t> out;
+		out.reserve(buf_entries);
+		uint64 out_pos = table_offsets[t];
+		for(uint32 b = 0; b < params->n_buckets; b++) {
+			const uint64 bid = t*params->n_buckets + b;
+			offsets[b] = out_pos + out.size();
+			bool skip = false;
+			for(uint32 p = 0; p < n_parts; p++) {
+				skip = skip || parts[p].bucket_skipped(bid);
+				next[p] = parts[p].bucket_start(bid);
+				if(next[p] < parts[p].bucket_start(bid + 1)) {
+					parts[p].get_entry(bid, next[p], heads[p]);
+					heads[p].pos += part_offsets[p];
+					heap.push(heap_item_t(loc_sort_key(heads[p]), p));
+				}
+			}
+			while(!heap.empty()) {
+				const uint32 p = heap.top().second;
+				heap.pop();
+				out.push_back(heads[p]);
+				if(out.size() == buf_entries) {
+					write_file_at(fd, out.data(), out.size()*sizeof(loc_t), header.entries_file_offset + out_pos*sizeof(loc_t));
+					out_pos += out.size();
+					out.clear();
+				}
+				next[p]++;
+				if(next[p] < parts[p].bucket_start(bid + 1)) {
+					parts[p].get_entry(bid, next[p], heads[p]);
+					heads[p].pos += part_offsets[p];
+					heap.push(heap_item_t(loc_sort_key(heads[p]), p));
+				}
+			}
+			const uint64 size = out_pos + out.size() - offsets[b];
+			skip = skip || params->hot_bucket(size);
+			table_stats[t].add(size, skip);
+			if(skip) {
+				offsets[b] |= BUCKET_SKIP_FLAG;
+			}
+		}
+		write_file_at(fd, out.data(), out.size()*sizeof(loc_t), header.entries_file_offset + out_pos*sizeof(loc_t));
+		store_bucket_directory(fd, header, t, offsets);
+	}
+	if(ftruncate(fd, header.entries_file_offset + header.entries_bytes) != 0) {
+		printf("merge_index_ref_lsh: Cannot resize the IDX file %s!\n", fname.c_str());
+		exit(1);
+	}
+	close(fd);
+	print_bucket_size_stats(table_stats, false, params);
+	for(uint32 p = 0; p < n_parts; p++) {
+		parts[p].release();
+	}
+	printf("Merged %u partial indexes into %s: %llu entries. Time : %.2f sec\n", n_parts,
+			fname.c_str(), n_entries, omp_get_wtime() - start_time);
+}
+
+static inline uint32 n_value_bits(const uint64 x) {
+	return (x == 0) ? 1 : 64 - __builtin_clzll(x);
+}
+
+// re-encodes the sorted raw entries as fixed-width bit-packed entries
+// entries are packed in chunks of 64 (each chunk spans exactly entry_bits words)
+void pack_index_entries(static_index_t& index, const index_params_t* params) {
+	double start_time = omp_get_wtime();
+	const uint64 n = index.buckets_data.size();
+	seq_t max_pos = 0;
+	len_t max_len = 0;
+	#pragma omp parallel for reduction(max:max_pos,max_len)
+	for(uint64 i = 0; i < n; i++) {
+		if(index.buckets_data[i].pos > max_pos) max_pos = index.buckets_data[i].pos;
+		if(index.buckets_data[i].len > max_len) max_len = index.buckets_data[i].len;
+	}
+	const uint32 rem_bits = 32 - params->n_buckets_pow2;
+	const uint32 pos_bits = n_value_bits(max_pos);
+	const uint32 len_bits = n_value_bits(max_len);
+	if(rem_bits == 0 || rem_bits + pos_bits + len_bits > 64) {
+		printf("Packed index entries require %u bits per entry (max 64), keeping the raw layout\n", rem_bits + pos_bits + len_bits);
+		return;
+	}
+	index.encoding = ENTRY_PACKED;
+	index.n_buckets_pow2 = params->n_buckets_pow2;
+	index.rem_bits = rem_bits;
+	index.pos_bits = pos_bits;
+	index.len_bits = len_bits;
+	index.entry_bits = rem_bits + pos_bits + len_bits;
+
+	const uint32 w = index.entry_bits;
+	const uint64 n_chunks = (n + 63) / 64;
+	index.packed_data.assign(n_chunks*w + 1, 0);
+	const uint64 rem_mask = (1ULL << rem_bits) - 1;
+	#pragma omp parallel for schedule(static)
+	for(uint64 c = 0; c < n_chunks; c++) {
+		uint64* words = &index.packed_data[c*w];
+		const uint64 end = std::min(n, (c + 1)*64);
+		for(uint64 i = c*64; i < end; i++) {
+			const loc_t& l = index.buckets_data[i];
+			const uint64 v = (((uint64) (l.hash & rem_mask)) << (pos_bits + len_bits)) | (((uint64) l.pos) << len_bits) | l.len;
+			const uint64 bit = (i - c*64)*w;
+			const uint32 off = bit & 63;
+			words[bit >> 6] |= v << off;
+			if(off + w > 64) {
+				words[(bit >> 6) + 1] |= v >> (64 - off);
+			}
+		}
+	}
+	index.n_entries = n;
+	std::vector<loc_t>().swap(index.buckets_data);
+	index.set_views();
+	printf("Packed index entries: %u bits/entry (hash %u, pos %u, len %u). Time : %.2f sec\n",
+			index.entry_bits, rem_bits, pos_bits, len_bits, omp_get_wtime() - start_time);
+}
+
+void load_index_ref_lsh(const char* fastaFname, const index_params_t* params, ref_t& ref) {
+	clock_t t = clock();
+	if(ref.seq.size() == 0) { // (the sequence is kept across the read batches)
+		printf("Loading FASTA file %s... \n", fastaFname);
+		fasta2ref(fastaFname, ref);
+		printf("Time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+	}
+
+	double start_time = omp_get_wtime();
+	if(load_ref_bundle(fastaFname, ref, params)) {
+		printf("Loaded the reference bundle. Time: %.2f sec\n", omp_get_wtime() - start_time);
+		return;
+	}
 	printf("Loading frequent kmers... \n");
 	t = clock();
-	load_freq_kmers(fastaFname, ref.high_freq_kmer_bitmap, ref.high_freq_kmer_trie, params->max_count);
+	load_freq_kmers(fastaFname, ref.high_freq_kmers, ref.high_freq_kmer_trie, params->max_count, params->k);
 	printf("Time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 
 	if(params->load_mhi) {
 		printf("Loading reference MinHash index... \n");
 		//t = clock();
-		double start_time = omp_get_wtime();
-		load_ref_idx(fastaFname, ref, params);
+		start_time = omp_get_wtime();
+		if(!load_ref_idx_flat(fastaFname, ref, params)) { // fall back to the legacy index format
+			load_ref_idx(fastaFname, ref, params);
+		}
 		printf("Time: %.2f sec\n", (float)(omp_get_wtime() - start_time));
 	}
 }
 
 void store_index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
+	if(params->mem_budget > 0) { // already stored by the external-memory builder
+		return;
+	}
 	printf("Storing the reference index for reference file %s... \n", fastaFname);
 	clock_t t = clock();
-	store_ref_idx(fastaFname, ref, params);
+	store_ref_idx_flat(fastaFname, ref, params);
 	printf("Reference index storing time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 }
 
-void mark_freq_kmers(ref_t& ref, const index_params_t* params) {
+// marks the frequent/ambiguous kmers starting at positions >= start_pos
+void mark_freq_kmers(ref_t& ref, const index_params_t* params, const seq_t start_pos) {
 	clock_t t = clock();
 	ref.ignore_kmer_bitmask.resize(ref.len - params->k);
 	#pragma omp parallel for
-	for(seq_t i = 0; i < ref.len - params->k + 1; i++) { // for each window of the genome
+	for(seq_t i = start_pos; i < ref.len - params->k + 1; i++) { // for each window of the genome
 #if USE_MARISA
 		marisa::Agent agent;
-		for (uint32 k = 0; k < params->k; k++) {
-			if(ref.seq.c_str()[i+k] == BASE_IGNORE) {
-				ref.ignore_kmer_bitmask[i] = 1; // contains ambiguous bases
-				break;
-			}
+		if(ref.seq.has_ambiguous(i, params->k)) {
+			ref.ignore_kmer_bitmask[i] = 1; // contains ambiguous bases
 		}
-		agent.set_query(&ref.seq.c_str()[i], params->k);
+		char kmer[BASES_PER_LWORD];
+		ref.seq.unpack(i, params->k, kmer);
+		agent.set_query(kmer, params->k);
 		if(ref.high_freq_kmer_trie.lookup(agent)) {
 			ref.ignore_kmer_bitmask[i] = 1;
 		}
 #else
-		uint32_t packed_kmer;
-		if(pack_32(&ref.seq.c_str()[i], params->k, &packed_kmer) < 0) {
+		if(ref.seq.has_ambiguous(i, params->k)) {
 			ref.ignore_kmer_bitmask[i] = 1; // contains ambiguous bases
 			continue;
 		}
-		if(ref.high_freq_kmer_bitmap[packed_kmer]) {
+		const uint32_t packed_kmer = ref.seq.get_kmer(i, params->k) >> BITS_IN_WORD;
+		if(ref.high_freq_kmers.contains(packed_kmer)) {
 			ref.ignore_kmer_bitmask[i] = 1;
 		}
 #endif
@@ -286,15 +1134,11 @@ void mark_freq_kmers(ref_t& ref, const index_params_t* params) {
 	printf("Done marking frequent kmers time: %.2f sec \n", (float) (clock() - t)/CLOCKS_PER_SEC);
 }
 
-// checks if the given sequence is informative or not
+// checks if the window with the given base counts (A/C/G/T/ambiguous) is informative or not
 // e.g. non-informative seq: same character is repeated throughout the seq (NN...N)
 #define AMBIG_BASE_FRAC 50
 #define LOW_BASE_FRAC 100
-int is_inform_ref_window(const char* seq, const uint32_t len, const index_params_t* params) {
-	uint32 base_counts[5] = { 0 };
-	for(uint32 i = 0; i < len; i++) {
-		base_counts[(int) seq[i]]++;
-	}
+static inline int is_inform_ref_window(const uint32* base_counts, const index_params_t* params) {
 	if(base_counts[4] > params->ref_window_size/AMBIG_BASE_FRAC) { // N ambiguous bases
 		return 0;
 	}
@@ -314,12 +1158,43 @@ int is_inform_ref_window(const char* seq, const uint32_t len, const index_params
 	return 1;
 }
 
-void mark_windows_to_discard(ref_t& ref, const index_params_t* params) {
-	ref.ignore_window_bitmask.resize(ref.len - params->ref_window_size + 1);
-	#pragma omp parallel for
-	for(seq_t pos = 0; pos < ref.len - params->ref_window_size + 1; pos++) { // for each window of the genome
-		if(!is_inform_ref_window(&ref.seq.c_str()[pos], params->ref_window_size, params)) {
-			ref.ignore_window_bitmask[pos] = 1; // discard windows with low information content
+// marks the non-informative windows starting at the positions [start, end) given their bases (from start)
+// (the mask words of the range must not be shared with other threads)
+static void mark_window_block(ref_t& ref, const index_params_t* params, const seq_t start, const seq_t end, const char* bases) {
+	const uint32 w = params->ref_window_size;
+	uint32 base_counts[5] = { 0 };
+	for(uint32 i = 0; i < w - 1; i++) {
+		base_counts[(int) bases[i]]++;
+	}
+	for(seq_t pos = start; pos < end; pos++) { // for each window of the block
+		const char* window = &bases[pos - start];
+		base_counts[(int) window[w - 1]]++;
+		if(!is_inform_ref_window(base_counts, params)) {
+			ref.ignore_window_bitmask.set(pos); // discard windows with low information content
+		}
+		base_counts[(int) window[0]]--;
+	}
+}
+
+// marks the non-informative windows starting at positions >= start_pos
+// the windows are processed in blocks, each unpacking its range of the reference and
+// sliding the base counts of the window along it (O(1) per window)
+#define WINDOW_MASK_BLOCK_SIZE (1 << 16) // (multiple of 64: the blocks update separate words of the mask)
+void mark_windows_to_discard(ref_t& ref, const index_params_t* params, const seq_t start_pos) {
+	const seq_t n_windows = ref.len - params->ref_window_size + 1;
+	const uint32 w = params->ref_window_size;
+	ref.ignore_window_bitmask.resize(n_windows);
+	const seq_t first_block = start_pos / WINDOW_MASK_BLOCK_SIZE;
+	const seq_t n_blocks = (n_windows + WINDOW_MASK_BLOCK_SIZE - 1) / WINDOW_MASK_BLOCK_SIZE;
+	#pragma omp parallel
+	{
+		std::vector<char> bases(WINDOW_MASK_BLOCK_SIZE + w);
+		#pragma omp for schedule(dynamic)
+		for(seq_t b = first_block; b < n_blocks; b++) {
+			const seq_t block_start = std::max(start_pos, b*WINDOW_MASK_BLOCK_SIZE);
+			const seq_t block_end = std::min(n_windows, (b + 1)*WINDOW_MASK_BLOCK_SIZE);
+			ref.seq.unpack(block_start, block_end - block_start + w - 1, bases.data());
+			mark_window_block(ref, params, block_start, block_end, bases.data());
 		}
 	}
 }
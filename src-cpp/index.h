@@ -4,6 +4,7 @@
 #include <istream>
 #include <sstream>
 #include <iostream>
+#include <emmintrin.h>
 
 #include "utils.h"
 #include "seq.h"
@@ -13,11 +14,22 @@
 typedef enum {SIMH, MINH, SAMPLE} algorithm;
 typedef enum {OVERLAP, NON_OVERLAP, SPARSE} kmer_selection;
 typedef enum {SHA1_E = 0, CITY_HASH64 = 1, PACK64 = 2} kmer_hash_alg;
+typedef enum {ENTRY_RAW = 0, ENTRY_PACKED = 1} idx_entry_encoding;
 
 #include "hash.h"
 
 #define DISK_SYNC_PARTIAL_TABLES 0
 
+// default cap on the bucket size: the larger (hot) buckets are dropped at index time
+// and marked to be skipped by the queries
+#define MAX_BUCKET_SIZE 1000
+// the queries index into a bucket with 32-bit offsets: larger buckets are always skipped
+#define MAX_SEARCHED_BUCKET_SIZE UINT32_MAX
+
+// range of the automatically chosen bucket exponent (-p 0)
+#define MIN_N_BUCKETS_POW2 8
+#define MAX_N_BUCKETS_POW2 28
+
 // program parameters
 typedef struct {	
 	algorithm alg; 					// LSH scheme to use
@@ -32,21 +44,31 @@ typedef struct {
 	uint32 sketch_proj_len;			// length of the sketch projection
 	VectorU32 sketch_proj_indices;	// indices into the sketch for the sparse projections
 	uint32 n_buckets_pow2;  		// n_buckets in a hash table = 2^n_buckets_pow2
+	bool auto_n_buckets;			// n_buckets_pow2 chosen at index time from the number of valid windows (recorded in the index)
+	uint32 bucket_load;				// target number of indexed windows per bucket (auto n_buckets_pow2)
 	uint32 bucket_size;				// max number of entries to keep per bucket
+	uint32 max_bucket_size;			// buckets with more entries are skipped by the queries (0: MAX_SEARCHED_BUCKET_SIZE)
 	rand_hash_function_t sketch_proj_hash_func; // hash function for sketch projection vector hashing
 	VectorHashFunctions minhash_functions;	// hash functions for min-hash
 	kmer_hasher_t* kmer_hasher;		// function used to generate kmer hashes for the sequence set
 	uint32 ref_window_size;			// length of the reference windows to hash
+	uint32 ref_window_stride;		// only the windows starting at multiples of the stride are indexed
 	uint32 bucket_entry_coverage;
+	uint32 idx_entry_encoding;		// layout of the index bucket entries (raw loc_t or bit-packed)
+	uint64 mem_budget;				// memory budget (bytes) of the index entries, 0: build in memory
+	std::string append_fasta_fname;	// sequences to append to an existing index
 
 	// sequence kmer filtering
 	uint64 max_count;				// upper bound on kmer occurrence in the reference
 	uint64 min_count;				// lower bound on kmer occurrence in the read set
 
 	// candidate contigs
+	uint32 n_probes;				// number of additional buckets probed per table (multi-probe queries)
 	uint32 min_n_hits;
 	uint32 dist_best_hit; 			// how many fewer than best table hits to still keep
 	bool load_mhi;
+	uint32 idx_prefault;			// index mapping pre-fault mode (0: none, 1: MAP_POPULATE, 2: parallel page touch)
+	uint32 kmer2_mode;				// source of the reference kmer2 ciphers (0: load, 1: map the precomputed hashes, 2: compute on demand)
 	std::string precomp_contig_file_name;
 	uint32 max_matched_contig_len;
 	
@@ -76,22 +98,31 @@ typedef struct {
 
 	void set_default_index_params() {
 		load_mhi = true;
+		idx_prefault = 0;
+		kmer2_mode = 0;
 		kmer_type = OVERLAP;
 		h = 128;
 		n_tables = 78;
 		sketch_proj_len = 2;
-		n_buckets_pow2 = 18;
+		n_buckets_pow2 = 0; // auto
+		auto_n_buckets = true;
+		bucket_load = 128;
 		bucket_size = 200;
+		max_bucket_size = MAX_BUCKET_SIZE;
 		k = 16;
 		kmer_dist = 1;
 		bucket_entry_coverage = 10;
 		ref_window_size = 150;
+		ref_window_stride = 1;
+		idx_entry_encoding = ENTRY_RAW;
+		mem_budget = 0;
 		max_count = 800;
 		min_count = 0;
 		max_matched_contig_len = 100000;
 		
 		k2 = 20;
 		precomp_k2 = true;
+		n_probes = 0;
 		min_n_hits = 1;
 		dist_best_hit = 20;
 		n_init_anchors = 10;
@@ -134,6 +165,18 @@ typedef struct {
 		sketch_proj_hash_func = rand_hash_function_t(n_buckets_pow2, sketch_proj_len);
 	}
 
+	// number of buckets per table (the random sketch projection does not depend on it)
+	void set_n_buckets(const uint32 pow2) {
+		n_buckets_pow2 = pow2;
+		n_buckets = 1U << pow2;
+		sketch_proj_hash_func.M = pow2;
+	}
+
+	// hot buckets are marked to be skipped by the queries (max_bucket_size 0: only the unsearchable ones)
+	inline bool hot_bucket(const uint64 size) const {
+		return size > ((max_bucket_size > 0) ? (uint64) max_bucket_size : (uint64) MAX_SEARCHED_BUCKET_SIZE);
+	}
+
 	// generate random hash functions for min-hash sketches
 	void set_minhash_hash_function() {
 		for(uint32 f = 0; f < h; f++) {
@@ -171,46 +214,241 @@ extern index_params_t* params;
 // **** Reference Index ****
 typedef std::map<uint32, seq_t> MapKmerCounts;
 
-// min-hash signature index
-struct buckets_t {
-	uint32 n_entries; // total number of entries across all buckets
-	std::vector<VectorSeqPos> buckets_data_vectors;
-
-	// per thread local buckets
-	std::vector<std::vector<VectorSeqPos> > per_thread_buckets_data_vectors;
-	std::vector<VectorU32> per_thread_bucket_sizes;
+// set of frequent packed kmers: the sorted low bits of the kmers grouped by their high FREQ_KMER_PREFIX_BITS bits
+// (a direct-mapped table of group offsets, 2 bytes per kmer; the groups are scanned with SSE)
+#define FREQ_KMER_PREFIX_BITS 18
+#define FREQ_KMER_SUFFIX_BITS (BITS_IN_WORD - FREQ_KMER_PREFIX_BITS)
+struct freq_kmer_set_t {
+	std::vector<uint32> prefix_offsets_data;	// start of each prefix group in suffixes
+	std::vector<uint16_t> suffixes_data;		// (padded for the SSE loads)
+
+	// read-only views: point either to the vectors above or into a mapping of the reference bundle
+	const uint32* prefix_offsets;
+	const uint16_t* suffixes;
+	uint64 n_prefix_offsets;
+	uint64 n_suffixes;
+
+	freq_kmer_set_t() : prefix_offsets(NULL), suffixes(NULL), n_prefix_offsets(0), n_suffixes(0) {}
+
+	// builds the set from the given kmers (sorted in place)
+	void build(std::vector<uint32>& kmers) {
+		std::sort(kmers.begin(), kmers.end());
+		kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+		prefix_offsets_data.assign((1ULL << FREQ_KMER_PREFIX_BITS) + 1, 0);
+		suffixes_data.assign(kmers.size() + 8, 0);
+		for(uint64 i = 0; i < kmers.size(); i++) {
+			prefix_offsets_data[(kmers[i] >> FREQ_KMER_SUFFIX_BITS) + 1]++;
+			suffixes_data[i] = kmers[i] & ((1U << FREQ_KMER_SUFFIX_BITS) - 1);
+		}
+		for(uint64 p = 1; p < prefix_offsets_data.size(); p++) {
+			prefix_offsets_data[p] += prefix_offsets_data[p-1];
+		}
+		set_views(prefix_offsets_data.data(), prefix_offsets_data.size(), suffixes_data.data(), suffixes_data.size());
+	}
+	void set_views(const uint32* offsets, const uint64 n_offsets, const uint16_t* sfx, const uint64 n_sfx) {
+		prefix_offsets = offsets;
+		n_prefix_offsets = n_offsets;
+		suffixes = sfx;
+		n_suffixes = n_sfx;
+	}
+	inline bool contains(const uint32 kmer) const {
+		if(n_prefix_offsets == 0) return false;
+		const uint32 prefix = kmer >> FREQ_KMER_SUFFIX_BITS;
+		const __m128i suffix = _mm_set1_epi16(kmer & ((1U << FREQ_KMER_SUFFIX_BITS) - 1));
+		const uint16_t* group = suffixes + prefix_offsets[prefix];
+		const uint32 n = prefix_offsets[prefix + 1] - prefix_offsets[prefix];
+		for(uint32 i = 0; i < n; i += 8) {
+			const uint32 hits = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*) (group + i)), suffix));
+			if(hits != 0) {
+				return (uint32) __builtin_ctz(hits)/2 < n - i;
+			}
+		}
+		return false;
+	}
+	uint64 bytes() const {
+		return n_prefix_offsets*sizeof(uint32) + n_suffixes*sizeof(uint16_t);
+	}
 };
 
-typedef struct {
-	std::vector<buckets_t> per_table_buckets; // buckets for T tables
-} mutable_index_t;
+// two-level bucket directory: a 64-bit base offset per block of 2^BUCKET_DIR_BLOCK_BITS buckets
+// and a 16-bit (if all the blocks are small enough) or 32-bit offset of each bucket relative to its block
+// the top bit of the relative offset is the skip bit of the bucket (hot bucket, see max_bucket_size)
+#define BUCKET_DIR_BLOCK_BITS 8
+// skip bit of the build-time bucket offsets
+#define BUCKET_SKIP_FLAG (1ULL << 63)
 
-typedef struct {
-	// stores the bucket entries across all the tables
+// min-hash signature index (CSR layout)
+struct static_index_t {
+	// stores the bucket entries across all the tables (index construction, stream loading)
 	std::vector<loc_t> buckets_data;
-	// stores offsets for each bucket id
+	// stores offsets for each bucket id (index construction only, compacted into the bucket directory)
+	// the offsets of the skipped buckets carry BUCKET_SKIP_FLAG
 	std::vector<uint64> bucket_offsets;
-	void release() {
-		std::vector<loc_t>().swap(buckets_data);
-		std::vector<uint64>().swap(bucket_offsets);
+	// bucket directory (see BUCKET_DIR_BLOCK_BITS)
+	std::vector<uint64> dir_bases_data;
+	std::vector<uint16_t> dir_rel16_data;
+	std::vector<uint32> dir_rel32_data;
+	// bit-packed bucket entries (ENTRY_PACKED): [hash remainder | pos | len] in entry_bits bits each
+	// the top n_buckets_pow2 bits of the hash are implied by the bucket id
+	std::vector<uint64> packed_data;
+
+	// read-only views used for querying:
+	// point either to the vectors above or into a mapping of the flat index file
+	const loc_t* entries;
+	const uint64* packed;
+	const uint64* dir_bases;
+	const void* dir_rel;
+	uint64 n_entries;
+	uint64 n_offsets;
+	uint64 n_packed_words;
+	uint64 ref_len;		// length of the indexed reference (0 if not recorded, see idx_flat_header_t)
+	void* mapped_addr;
+	size_t mapped_len;
+
+	uint32 dir_block_bits;
+	uint32 dir_rel_bits;
+	uint32 encoding;
+	uint32 n_buckets_pow2;
+	uint32 rem_bits;
+	uint32 pos_bits;
+	uint32 len_bits;
+	uint32 entry_bits;
+
+	static_index_t() : entries(NULL), packed(NULL), dir_bases(NULL), dir_rel(NULL), n_entries(0), n_offsets(0), n_packed_words(0), ref_len(0),
+			mapped_addr(NULL), mapped_len(0), dir_block_bits(0), dir_rel_bits(32), encoding(ENTRY_RAW), n_buckets_pow2(0),
+			rem_bits(0), pos_bits(0), len_bits(0), entry_bits(0) {}
+
+	void set_views() {
+		entries = buckets_data.data();
+		packed = packed_data.data();
+		dir_bases = dir_bases_data.data();
+		dir_rel = (dir_rel_bits == 16) ? (const void*) dir_rel16_data.data() : (const void*) dir_rel32_data.data();
+		n_entries = (encoding == ENTRY_RAW) ? buckets_data.size() : n_entries;
+		n_offsets = (dir_rel_bits == 16) ? dir_rel16_data.size() : dir_rel32_data.size();
+		n_packed_words = packed_data.size();
+	}
+	void build_bucket_directory(const uint32 n_buckets_pow2);
+	inline uint32 dir_rel_entry(const uint64 bid) const {
+		return (dir_rel_bits == 16) ? ((const uint16_t*) dir_rel)[bid] : ((const uint32*) dir_rel)[bid];
+	}
+	inline uint64 bucket_start(const uint64 bid) const {
+		return dir_bases[bid >> dir_block_bits] + (dir_rel_entry(bid) & ((1U << (dir_rel_bits - 1)) - 1));
+	}
+	inline bool bucket_skipped(const uint64 bid) const {
+		return dir_rel_entry(bid) >> (dir_rel_bits - 1);
 	}
+	inline uint64 bucket_size(const uint64 bid) const {
+		return bucket_start(bid + 1) - bucket_start(bid);
+	}
+	uint64 directory_bytes() const {
+		return (n_offsets == 0) ? 0 : (((n_offsets - 1) >> dir_block_bits) + 1)*sizeof(uint64) + n_offsets*dir_rel_bits/8;
+	}
+
+	// packed entry i (entry_bits <= 64, the data is padded by one word)
+	inline uint64 packed_entry(const uint64 i) const {
+		const uint64 bit = i*entry_bits;
+		const uint64 w = bit >> 6;
+		const uint32 off = bit & 63;
+		uint64 v = packed[w] >> off;
+		if(off + entry_bits > 64) {
+			v |= packed[w + 1] << (64 - off);
+		}
+		return (entry_bits == 64) ? v : (v & ((1ULL << entry_bits) - 1));
+	}
+	inline void get_entry(const uint64 bid, const uint64 i, loc_t& l) const {
+		if(encoding == ENTRY_RAW) {
+			l = entries[i];
+			return;
+		}
+		const uint64 v = packed_entry(i);
+		l.len = v & ((1ULL << len_bits) - 1);
+		l.pos = (v >> len_bits) & ((1ULL << pos_bits) - 1);
+		l.hash = ((bid & ((1ULL << n_buckets_pow2) - 1)) << rem_bits) | (v >> (pos_bits + len_bits));
+	}
+	// index (relative to the bucket start) of the first entry in the bucket with hash >= the given hash
+	inline uint64 bucket_lower_bound(const uint64 bid, const minhash_t hash) const {
+		const uint64 start = bucket_start(bid);
+		uint64 lo = 0;
+		uint64 hi = bucket_size(bid);
+		if(encoding == ENTRY_RAW) {
+			while(lo < hi) {
+				const uint64 mid = (lo + hi) >> 1;
+				if(entries[start + mid].hash < hash) lo = mid + 1; else hi = mid;
+			}
+			return lo;
+		}
+		const minhash_t rem = hash & ((1ULL << rem_bits) - 1);
+		const uint32 shift = pos_bits + len_bits;
+		while(lo < hi) {
+			const uint64 mid = (lo + hi) >> 1;
+			if((packed_entry(start + mid) >> shift) < rem) lo = mid + 1; else hi = mid;
+		}
+		return lo;
+	}
+	uint64 entries_bytes() const {
+		return (encoding == ENTRY_RAW) ? n_entries*sizeof(loc_t) : n_packed_words*sizeof(uint64);
+	}
+	void release();
+};
+
+// reference kmer2 ciphers of the candidate contigs (alignment)
+// either a view of all the precomputed hashes (loaded or mapped)
+// or the ciphers of the contig ranges of the current read batch, computed on demand
+struct kmer2_ciphers_t {
+	const kmer_cipher_t* all_hashes;	// NULL if computed on demand
+	void* mapped_addr;
+	size_t mapped_len;
+	bool no_precomputed;	// the precomputed hashes could not be loaded or mapped (not retried)
+
+	// disjoint kmer2 ranges [start, end) sorted by position and their offsets into range_ciphers
+	std::vector<seq_t> range_starts;
+	std::vector<seq_t> range_ends;
+	std::vector<uint64> range_offsets;
+	std::vector<kmer_cipher_t> range_ciphers;
+
+	kmer2_ciphers_t() : all_hashes(NULL), mapped_addr(NULL), mapped_len(0), no_precomputed(false) {}
+
+	// ciphers of the kmer2s starting at pos, NULL if pos is outside every computed range
+	// (contigs without any kmer2 within the reference are not computed)
+	inline const kmer_cipher_t* get(const seq_t pos) const {
+		if(all_hashes != NULL) {
+			return &all_hashes[pos];
+		}
+		const size_t r = std::upper_bound(range_starts.begin(), range_starts.end(), pos) - range_starts.begin();
+		if(r == 0 || pos >= range_ends[r - 1]) return NULL;
+		return &range_ciphers[range_offsets[r - 1] + (pos - range_starts[r - 1])];
+	}
+	uint64 range_bytes() const {
+		return range_ciphers.size()*sizeof(kmer_cipher_t);
+	}
+	void release();
+};
 
-} static_index_t;
+// reference bundle in use by the queries (see load_ref_bundle): its sections are mapped separately,
+// verified once per run and used in place; the index section is mapped again for each read batch
+struct ref_bundle_t {
+	std::vector<std::pair<void*, size_t> > mappings;	// (kept until the end of the run)
+	uint64 index_offset;
+	uint64 index_bytes;
+	const uint16_t* neighbor_repeats;	// kmer2 repeats section
+	bool loaded;
+
+	ref_bundle_t() : index_offset(0), index_bytes(0), neighbor_repeats(NULL), loaded(false) {}
+};
 
 // reference genome index
 typedef struct {
-	std::string seq; 					// reference sequence
+	packed_seq_t seq; 				// reference sequence (2-bit packed)
 	seq_t len;							// reference sequence length
 	VectorU32 subsequence_offsets;
 
 	MapKmerCounts kmer_hist;			// kmer occurrence histogram
 	MarisaTrie high_freq_kmer_trie;		// frequent reference kmers TRIE
-	VectorBool high_freq_kmer_bitmap;	// frequent reference kmers bitmap
+	freq_kmer_set_t high_freq_kmers;	// frequent reference kmers
 	VectorBool ignore_kmer_bitmask;
-	VectorBool ignore_window_bitmask;
+	bitmap_t ignore_window_bitmask;
 
 	// lsh
-	mutable_index_t mutable_index;
 	static_index_t index;
 
 	// voting
@@ -218,6 +456,8 @@ typedef struct {
 	std::vector<kmer_cipher_t> precomputed_kmer2_hashes;
 	std::vector<uint16_t> precomputed_neighbor_repeats;
 	std::vector<char> contig_mask;
+	kmer2_ciphers_t kmer2_ciphers;
+	ref_bundle_t bundle;
 
 	//std::vector<char> precomputed_local_repeats;
 	//std::unordered_set<uint32> repeats;
@@ -257,6 +497,8 @@ struct read_t {
 	// LSH sketches
 	VectorMinHash minhashes_f;		// minhash vector
 	VectorMinHash minhashes_rc;	// minhash vector for the reverse complement
+	VectorMinHash next_minhashes_f;	// second smallest hash values (multi-probe queries)
+	VectorMinHash next_minhashes_rc;
 
 	// alignment information
 	std::vector<std::pair<uint64, minhash_t>> ref_bucket_matches_by_table_f;
@@ -404,6 +646,14 @@ typedef struct {
 } reads_t;
 
 void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& refidx);
+void append_index_ref_lsh(const char* fastaFname, const char* extraFname, index_params_t* params, ref_t& ref);
+void merge_index_ref_lsh(const char* fastaFname, const std::vector<std::string>& partFnames, index_params_t* params);
+void prep_ref(const char* fastaFname, index_params_t* params);
+void bundle_ref(const char* fastaFname, index_params_t* params);
+void load_index_n_buckets(const char* fastaFname, index_params_t* params, const bool use_bundle);
+void sort_bucket_entries(loc_t* entries, const uint64 n, std::vector<loc_t>& buffer);
+void sort_index_buckets(static_index_t& index, const index_params_t* params);
+void pack_index_entries(static_index_t& index, const index_params_t* params);
 void load_index_ref_lsh(const char* fastaFname, const index_params_t* params, ref_t& ref);
 void store_index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref);
 void ref_kmer_fingerprint_stats(const char* fastaFname, index_params_t* params, ref_t& ref);
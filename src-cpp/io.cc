@@ -4,7 +4,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <fstream>
+#include <algorithm>
 #include <limits.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <smmintrin.h>
 #include "io.h"
 #include "types.h"
 
@@ -15,45 +24,330 @@ void fasta_error(const char* fastaFname) {
 	exit(1);
 }
 
-// reads the sequence data from the FASTA file
-void fasta2ref(const char *fastaFname, ref_t& ref) {
-	FILE* fastaFile = (FILE*) fopen(fastaFname, "r");
-	if (fastaFile == NULL) {
-		printf("fasta2ref: Cannot open FASTA file: %s!\n", fastaFname);
+#define FASTA_CHUNK_SIZE (1 << 20) // bytes of sequence data translated per task
+#define GZIP_READ_SIZE (1 << 20)
+
+static inline bool is_gzip_data(const char* data, const uint64 size) {
+	return size >= 2 && (unsigned char) data[0] == 0x1f && (unsigned char) data[1] == 0x8b;
+}
+
+// decompresses the gzip file into buf
+static void read_gzip_file(const char* fname, std::vector<char>& buf) {
+	gzFile file = gzopen(fname, "rb");
+	if (file == NULL) {
+		printf("read_gzip_file: Cannot open file: %s!\n", fname);
 		exit(1);
 	}
-	char c = (char) getc(fastaFile);
-	if(c != '>') fasta_error(fastaFname);
-	while(!feof(fastaFile)) {
-		c = (char) getc(fastaFile);
+	gzbuffer(file, GZIP_READ_SIZE);
+	uint64 size = 0;
+	while(true) {
+		buf.resize(size + GZIP_READ_SIZE);
+		const int n = gzread(file, &buf[size], GZIP_READ_SIZE);
+		if(n < 0) {
+			printf("read_gzip_file: Error decompressing file: %s!\n", fname);
+			exit(1);
+		}
+		size += n;
+		if(n == 0) break;
+	}
+	buf.resize(size);
+	gzclose(file);
+}
 
-		ref.subsequence_offsets.push_back(ref.seq.size());
-		// sequence description line (> ...)
-		while(c != '\n' && !feof(fastaFile)){
-			c = (char) getc(fastaFile);
+// number of line feeds in s[0, n)
+static uint64 count_line_feeds(const char* s, const uint64 n) {
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint64 count = 0;
+	uint64 i = 0;
+	for(; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)));
+	}
+	for(; i < n; i++) {
+		count += (s[i] == '\n');
+	}
+	return count;
+}
+
+// shuffle mask moving the bytes [k, 16) of a block to the front: the 16 bytes at offset k
+static const char shift_left_bytes[32] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128};
+
+// translates the bases of s[0, n) through nt4_table into out, skipping the line feeds
+// (out_len: number of translated bases, out is not written past them)
+static void translate_nt4(const char* s, const uint64 n, char* out, const uint64 out_len) {
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i case_mask = _mm_set1_epi8((char) 0xDF); // upper case (non-letters cannot become A/C/G/T)
+	const __m128i A = _mm_set1_epi8('A');
+	const __m128i C = _mm_set1_epi8('C');
+	const __m128i G = _mm_set1_epi8('G');
+	const __m128i T = _mm_set1_epi8('T');
+	char* out_end = out + out_len;
+	uint64 i = 0;
+	for(; i + 16 <= n && out + 16 <= out_end; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		const __m128i u = _mm_and_si128(v, case_mask);
+		__m128i r = _mm_set1_epi8(4);
+		r = _mm_blendv_epi8(r, _mm_set1_epi8(nt4_table['A']), _mm_cmpeq_epi8(u, A));
+		r = _mm_blendv_epi8(r, _mm_set1_epi8(nt4_table['C']), _mm_cmpeq_epi8(u, C));
+		r = _mm_blendv_epi8(r, _mm_set1_epi8(nt4_table['G']), _mm_cmpeq_epi8(u, G));
+		r = _mm_blendv_epi8(r, _mm_set1_epi8(nt4_table['T']), _mm_cmpeq_epi8(u, T));
+		uint32 lf_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		if(lf_mask == 0) {
+			_mm_storeu_si128((__m128i*) out, r);
+			out += 16;
+			continue;
+		}
+		// drop the line feeds: store the bytes of each line segment (the next store overwrites the tail)
+		uint32 seg_start = 0;
+		while(lf_mask != 0 && out + 16 <= out_end) {
+			const uint32 p = __builtin_ctz(lf_mask);
+			_mm_storeu_si128((__m128i*) out, _mm_shuffle_epi8(r, _mm_loadu_si128((const __m128i*) (shift_left_bytes + seg_start))));
+			out += p - seg_start;
+			seg_start = p + 1;
+			lf_mask &= lf_mask - 1;
+		}
+		if(lf_mask != 0 || out + 16 > out_end) { // finish the block
+			for(uint32 j = seg_start; j < 16; j++) {
+				if(s[i + j] != '\n') *out++ = nt4_table[(unsigned char) s[i + j]];
+			}
+			continue;
 		}
-		if(feof(fastaFile)) fasta_error(fastaFname);
+		_mm_storeu_si128((__m128i*) out, _mm_shuffle_epi8(r, _mm_loadu_si128((const __m128i*) (shift_left_bytes + seg_start))));
+		out += 16 - seg_start;
+	}
+	for(; i < n; i++) {
+		if(s[i] != '\n') *out++ = nt4_table[(unsigned char) s[i]];
+	}
+}
 
-		// sequence data
-		while(c != '>' && !feof(fastaFile)){
-			if (c != '\n'){
-				if (c >= 'a' && c <= 'z'){
-					c += 'A'-'a';
-				}
-				ref.seq.append(1, nt4_table[(int) c]);
+// sequence data range of a record split into chunks
+struct fasta_chunk_t {
+	uint64 begin;
+	uint64 end;
+	uint64 out_offset;
+	uint64 out_len;
+	uint32 record;
+	std::vector<std::pair<seq_t, seq_t> > n_runs; // ambiguous base runs of the chunk
+};
+
+// packs 32 translated bases into a word (first base in the top bits, BASE_IGNORE as 0)
+static inline uint64 pack_nt4_word(const char* s) {
+	const __m128i code_mask = _mm_set1_epi8(CHAR_MASK);
+	const __m128i pair_mul = _mm_set1_epi16(0x0104); // b0*4 + b1
+	const __m128i quad_mul = _mm_set1_epi32(0x00010010); // p0*16 + p1
+	const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+	const __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i*) s), code_mask);
+	const __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i*) (s + 16)), code_mask);
+	const __m128i lo_bytes = _mm_shuffle_epi8(_mm_madd_epi16(_mm_maddubs_epi16(lo, pair_mul), quad_mul), gather);
+	const __m128i hi_bytes = _mm_shuffle_epi8(_mm_madd_epi16(_mm_maddubs_epi16(hi, pair_mul), quad_mul), gather);
+	const uint64 v = (uint32) _mm_cvtsi128_si32(lo_bytes) | ((uint64) (uint32) _mm_cvtsi128_si32(hi_bytes) << 32);
+	return __builtin_bswap64(v);
+}
+
+// packs the translated bases s[0, n) into seq at offset and collects the runs of ambiguous bases
+// (only the words shared with the neighboring chunks are updated atomically)
+static void pack_nt4(const char* s, const uint64 n, packed_seq_t& seq, const uint64 offset, std::vector<std::pair<seq_t, seq_t> >& n_runs) {
+	uint64 i = 0;
+	while(i < n) {
+		const uint64 w = (offset + i) / BASES_PER_LWORD;
+		const uint32 j = (offset + i) % BASES_PER_LWORD;
+		const uint32 n_bases = std::min((uint64) (BASES_PER_LWORD - j), n - i);
+		if(n_bases == BASES_PER_LWORD) {
+			seq.words[w] = pack_nt4_word(s + i);
+		} else {
+			uint64 v = 0;
+			for(uint32 t = 0; t < n_bases; t++) {
+				v = (v << BITS_PER_CHAR) | (s[i + t] & CHAR_MASK); // (BASE_IGNORE & CHAR_MASK == 0)
 			}
-			c = (char) getc(fastaFile);
+			v <<= (BASES_PER_LWORD - j - n_bases)*BITS_PER_CHAR;
+			__sync_fetch_and_or(&seq.words[w], v);
+		}
+		i += n_bases;
+	}
+	const char* p = s;
+	const char* end = s + n;
+	while((p = (const char*) memchr(p, BASE_IGNORE, end - p)) != NULL) {
+		const char* q = p;
+		while(q < end && *q == BASE_IGNORE) q++;
+		n_runs.push_back(std::make_pair(offset + (p - s), offset + (q - s)));
+		p = q;
+	}
+}
+
+// parses the FASTA records in data[0, size) and appends their sequences to ref
+// the record boundaries are located first, then the data is translated in parallel chunks into the presized sequence
+static void parse_fasta_data(const char* fastaFname, const char* data, const uint64 size, ref_t& ref) {
+	if(size == 0 || data[0] != '>') fasta_error(fastaFname);
+	std::vector<fasta_chunk_t> chunks;
+	uint32 n_records = 0;
+	uint64 pos = 0;
+	while(pos < size) { // data[pos] == '>'
+		// sequence description line (> ...)
+		const char* header_end = (const char*) memchr(data + pos + 1, '\n', size - pos - 1);
+		if(header_end == NULL) fasta_error(fastaFname);
+		// sequence data (up to the next record)
+		const uint64 begin = header_end - data;
+		const char* next = (const char*) memchr(header_end, '>', size - begin);
+		const uint64 end = (next != NULL) ? next - data : size;
+		for(uint64 b = begin; b < end; b += FASTA_CHUNK_SIZE) { // (the data starts with the header line feed)
+			fasta_chunk_t chunk = fasta_chunk_t();
+			chunk.begin = b;
+			chunk.end = std::min(end, b + FASTA_CHUNK_SIZE);
+			chunk.record = n_records;
+			chunks.push_back(chunk);
 		}
+		n_records++;
+		pos = end;
+	}
+
+	// output offsets of the chunks
+	#pragma omp parallel for schedule(dynamic)
+	for(uint64 c = 0; c < chunks.size(); c++) {
+		chunks[c].out_len = (chunks[c].end - chunks[c].begin) - count_line_feeds(data + chunks[c].begin, chunks[c].end - chunks[c].begin);
+	}
+	uint64 offset = ref.seq.size();
+	for(uint64 c = 0; c < chunks.size(); c++) {
+		if(c == 0 || chunks[c].record != chunks[c-1].record) {
+			ref.subsequence_offsets.push_back(offset);
+		}
+		chunks[c].out_offset = offset;
+		offset += chunks[c].out_len;
+	}
+	if(offset > UINT32_MAX) {
+		printf("fasta2ref: Reference %s is too long (%llu bases)!\n", fastaFname, offset);
+		exit(1);
+	}
+	ref.seq.resize(offset);
+
+	#pragma omp parallel
+	{
+		std::vector<char> buf(FASTA_CHUNK_SIZE);
+		#pragma omp for schedule(dynamic)
+		for(uint64 c = 0; c < chunks.size(); c++) {
+			translate_nt4(data + chunks[c].begin, chunks[c].end - chunks[c].begin, buf.data(), chunks[c].out_len);
+			pack_nt4(buf.data(), chunks[c].out_len, ref.seq, chunks[c].out_offset, chunks[c].n_runs);
+		}
+	}
+	for(uint64 c = 0; c < chunks.size(); c++) {
+		for(uint64 r = 0; r < chunks[c].n_runs.size(); r++) {
+			ref.seq.add_n_run(chunks[c].n_runs[r].first, chunks[c].n_runs[r].second);
+		}
+	}
+}
+
+// reads the sequence data from the FASTA file (plain or gzip-compressed)
+// plain files are mapped and parsed in place
+void fasta2ref(const char *fastaFname, ref_t& ref) {
+	int fd = open(fastaFname, O_RDONLY);
+	if (fd < 0) {
+		printf("fasta2ref: Cannot open FASTA file: %s!\n", fastaFname);
+		exit(1);
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		printf("fasta2ref: Cannot open FASTA file: %s!\n", fastaFname);
+		exit(1);
+	}
+	if(st.st_size == 0) fasta_error(fastaFname);
+	void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED) {
+		printf("fasta2ref: Cannot map FASTA file: %s!\n", fastaFname);
+		std::cerr << "Error: " << strerror(errno) << "\n";
+		exit(1);
+	}
+	if(is_gzip_data((const char*) addr, st.st_size)) {
+		munmap(addr, st.st_size);
+		std::vector<char> buf;
+		read_gzip_file(fastaFname, buf);
+		parse_fasta_data(fastaFname, buf.data(), buf.size(), ref);
+	} else {
+		madvise(addr, st.st_size, MADV_WILLNEED);
+		parse_fasta_data(fastaFname, (const char*) addr, st.st_size, ref);
+		munmap(addr, st.st_size);
 	}
 	ref.len = ref.seq.size();
 	printf("Done reading FASTA file. Number of subsequences: %zu. Total sequence length read = %u\n", ref.subsequence_offsets.size(), ref.len);
+}
+
+// writes the records of the FASTA file fastaFname followed by the records of extraFname (plain or gzip-compressed)
+// to outFname (a gzip-compressed fastaFname is copied as is and extended by a new gzip member)
+void append_fasta(const char* fastaFname, const char* extraFname, const char* outFname) {
+	gzFile extraFile = gzopen(extraFname, "rb");
+	if (extraFile == NULL) {
+		printf("append_fasta: Cannot open FASTA file: %s!\n", extraFname);
+		exit(1);
+	}
+	FILE* fastaFile = fopen(fastaFname, "rb");
+	if (fastaFile == NULL) {
+		printf("append_fasta: Cannot open FASTA file: %s!\n", fastaFname);
+		exit(1);
+	}
+	FILE* outFile = fopen(outFname, "wb");
+	if (outFile == NULL) {
+		printf("append_fasta: Cannot open FASTA file: %s!\n", outFname);
+		exit(1);
+	}
+	char magic[2];
+	const bool gzip_fasta = fread(magic, 1, 2, fastaFile) == 2 && is_gzip_data(magic, 2);
+	rewind(fastaFile);
+
+	// 1. copy the reference records
+	char buf[1 << 16];
+	size_t n_read;
+	char last = '\n';
+	while((n_read = fread(buf, 1, sizeof(buf), fastaFile)) > 0) {
+		if(fwrite(buf, 1, n_read, outFile) != n_read) {
+			printf("append_fasta: Error writing FASTA file: %s!\n", outFname);
+			exit(1);
+		}
+		last = buf[n_read - 1];
+	}
+	if(ferror(fastaFile)) {
+		printf("append_fasta: Error reading FASTA file: %s!\n", fastaFname);
+		exit(1);
+	}
 	fclose(fastaFile);
+	gzFile gzOutFile = NULL;
+	if(gzip_fasta) { // the line feed separates the new records from a possibly unterminated last line
+		if(fclose(outFile) != 0) {
+			printf("append_fasta: Error writing FASTA file: %s!\n", outFname);
+			exit(1);
+		}
+		outFile = NULL;
+		gzOutFile = gzopen(outFname, "ab");
+		if (gzOutFile == NULL || gzputc(gzOutFile, '\n') < 0) {
+			printf("append_fasta: Cannot open FASTA file: %s!\n", outFname);
+			exit(1);
+		}
+	} else if(last != '\n') { // the new records must start on a new line
+		putc('\n', outFile);
+	}
+
+	// 2. append the new records
+	int n;
+	while((n = gzread(extraFile, buf, sizeof(buf))) > 0) {
+		if((gzip_fasta && gzwrite(gzOutFile, buf, n) != n) || (!gzip_fasta && fwrite(buf, 1, n, outFile) != (size_t) n)) {
+			printf("append_fasta: Error writing FASTA file: %s!\n", outFname);
+			exit(1);
+		}
+	}
+	if(n < 0) {
+		printf("append_fasta: Error decompressing FASTA file: %s!\n", extraFname);
+		exit(1);
+	}
+	gzclose(extraFile);
+	if((gzip_fasta && gzclose(gzOutFile) != Z_OK) || (!gzip_fasta && fclose(outFile) != 0)) {
+		printf("append_fasta: Error writing FASTA file: %s!\n", outFname);
+		exit(1);
+	}
 }
 
+// the mask is stored as its number of windows followed by the 64-bit words of the bitmap
+// (the legacy files store one '0'/'1' byte per window)
 void store_valid_window_mask(const char* refFname, const ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".window_mask.");
-	fname += std::to_string(params->ref_window_size);
+	std::string fname = get_window_mask_fname(refFname, params);
 
 	std::ofstream file;
 	file.open(fname.c_str(), std::ios::out | std::ios::binary);
@@ -62,23 +356,18 @@ void store_valid_window_mask(const char* refFname, const ref_t& ref, const index
 		printf("store_valid_window_mask: Cannot open the mask file %s!\n", fname.c_str());
 		exit(1);
 	}
-	for (uint32 i = 0; i < ref.ignore_window_bitmask.size(); i++) {
-		if(ref.ignore_window_bitmask[i]) {
-			char b = '1';
-			file.write(reinterpret_cast<char*>(&b), sizeof(char));
-		} else {
-			char b = '0';
-			file.write(reinterpret_cast<char*>(&b), sizeof(char));
-		}
-
+	const uint64 n_windows = ref.ignore_window_bitmask.size();
+	file.write(reinterpret_cast<const char*>(&n_windows), sizeof(n_windows));
+	file.write(reinterpret_cast<const char*>(ref.ignore_window_bitmask.words.data()), ref.ignore_window_bitmask.words.size()*sizeof(uint64));
+	if(!file) {
+		printf("store_valid_window_mask: Error writing the mask file %s!\n", fname.c_str());
+		exit(1);
 	}
 	file.close();
 }
 
 bool load_valid_window_mask(const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".window_mask.");
-	fname += std::to_string(params->ref_window_size);
+	std::string fname = get_window_mask_fname(refFname, params);
 
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
@@ -87,40 +376,75 @@ bool load_valid_window_mask(const char* refFname, ref_t& ref, const index_params
 		printf("load_valid_window_mask: Could not open the mask file %s!\n", fname.c_str());
 		return false;
 	}
-	char b;
-	ref.ignore_window_bitmask.resize(ref.len - params->ref_window_size + 1);
-	for(seq_t pos = 0; pos < ref.len - params->ref_window_size + 1; pos++) {
-		file.read(reinterpret_cast<char*>(&b), sizeof(char));
-		if(b == '1') {
-			ref.ignore_window_bitmask[pos] = 1;
+	const uint64 n_windows = ref.len - params->ref_window_size + 1;
+	file.seekg(0, std::ios::end);
+	const uint64 file_size = file.tellg();
+	file.seekg(0, std::ios::beg);
+	ref.ignore_window_bitmask.resize(n_windows);
+	uint64 n_mask_windows = 0;
+	file.read(reinterpret_cast<char*>(&n_mask_windows), sizeof(n_mask_windows));
+	if(file && n_mask_windows == n_windows && file_size == sizeof(n_windows) + ref.ignore_window_bitmask.words.size()*sizeof(uint64)) {
+		file.read(reinterpret_cast<char*>(ref.ignore_window_bitmask.words.data()), ref.ignore_window_bitmask.words.size()*sizeof(uint64));
+	} else if(file_size == n_windows) { // legacy mask (converted)
+		std::vector<char> mask(n_windows);
+		file.seekg(0, std::ios::beg);
+		file.read(mask.data(), n_windows);
+		for(uint64 pos = 0; pos < n_windows; pos++) {
+			if(mask[pos] == '1') {
+				ref.ignore_window_bitmask.set(pos);
+			}
 		}
+		file.close();
+		store_valid_window_mask(refFname, ref, params);
+		return true;
+	} else {
+		printf("load_valid_window_mask: The mask file %s does not match the reference!\n", fname.c_str());
+		return false;
+	}
+	if(!file) {
+		printf("load_valid_window_mask: Error reading the mask file %s!\n", fname.c_str());
+		exit(1);
 	}
 	file.close();
 	return true;
 }
 
+// contig_mask[i] is set if a kmer2 of the contig [i, i + max_contig_len) has its next occurrence
+// within max_contig_len positions (the flagged positions are counted over a sliding window)
 void compute_ref_repeat_mask(ref_t& ref) {
 	const seq_t max_contig_len = params->max_matched_contig_len/10;
+	if(ref.len < max_contig_len) {
+		ref.contig_mask.clear();
+		return;
+	}
 	const seq_t n_contigs = ref.len - max_contig_len + 1;
+	const seq_t n_kmers = ref.precomputed_neighbor_repeats.size();
 	ref.contig_mask.resize(n_contigs);
-	
-	#pragma omp parallel for
-	for(seq_t i = 0; i < n_contigs; i++) {
-		for(int j = 0; j < max_contig_len; j++) {
-			const uint16_t r = ref.precomputed_neighbor_repeats[i+j]; // distance to closest repeat
-			const seq_t next_occ =  i + r;
-			if(r == 0 || next_occ >= i + max_contig_len) continue; // unique kmer
-			ref.contig_mask[i] = 1;
-			break;
+	const uint16_t* repeats = ref.precomputed_neighbor_repeats.data();
+	auto is_close_repeat = [&](const seq_t pos) {
+		return pos < n_kmers && repeats[pos] != 0 && repeats[pos] < max_contig_len;
+	};
+
+	const uint32 n_slices = params->n_threads;
+	#pragma omp parallel for schedule(static, 1)
+	for(uint32 s = 0; s < n_slices; s++) {
+		const seq_t first = (uint64) n_contigs*s/n_slices;
+		const seq_t last = (uint64) n_contigs*(s + 1)/n_slices;
+		if(first == last) continue;
+		seq_t n_close = 0;
+		for(seq_t j = 0; j < max_contig_len; j++) {
+			n_close += is_close_repeat(first + j);
+		}
+		for(seq_t i = first; i < last; i++) {
+			ref.contig_mask[i] = (n_close > 0);
+			n_close += is_close_repeat(i + max_contig_len);
+			n_close -= is_close_repeat(i);
 		}
 	}
 }
 
 bool load_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".rep.");
-	fname += std::to_string(params->k2);
-	fname += std::to_string(params->kmer_hashing_alg);
+	std::string fname = get_repeat_info_fname(refFname, params);
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
 	if (!file.is_open()) {
@@ -162,74 +486,272 @@ bool load_repeat_info(const char* refFname, ref_t& ref, const index_params_t* pa
         return true;
 }*/
 
-void compute_store_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params) {
-	ref.precomputed_kmer2_hashes.resize(ref.len - params->k2 + 1);
-	//#pragma omp parallel for
-	for (seq_t pos = 0; pos < ref.len - params->k2 + 1; pos++) {
+// the reference is unpacked in blocks of KMER2_BLOCK_SIZE kmers
+#define KMER2_BLOCK_SIZE (1 << 16)
+
+// hashes of the first n_kmers kmer2s of the unpacked bases
+void hash_kmer2_bases(const index_params_t* params, const char* bases, const seq_t n_kmers, kmer_cipher_t* hashes) {
+	if (params->kmer_hashing_alg == SHA1_E) {
+		sha1_kmer_ciphers(bases, params->k2, n_kmers, hashes);
+		return;
+	}
+	for (seq_t i = 0; i < n_kmers; i++) {
+		const char* kmer = &bases[i];
 		switch(params->kmer_hashing_alg) {
-			case SHA1_E:
-				uint32_t hash[5];
-				sha1_hash(reinterpret_cast<const uint8_t*>(&ref.seq[pos]), params->k2, hash);
-				ref.precomputed_kmer2_hashes[pos] = ((uint64) hash[0] << 32 | hash[1]);
-				break;
 			case CITY_HASH64:
-				ref.precomputed_kmer2_hashes[pos] = CityHash64(&ref.seq[pos], params->k2);
+				hashes[i] = CityHash64(kmer, params->k2);
 				break;
 			case PACK64:
-				pack_64(&ref.seq[pos], params->k2, &ref.precomputed_kmer2_hashes[pos]);
+				pack_64(kmer, params->k2, &hashes[i]);
+				break;
+			case SHA1_E: // (hashed in batches above)
 				break;
 		}
 	}
-	std::string fname(refFname);
-	fname += std::string(".hash.");
-	fname += std::to_string(params->k2);
-	fname += std::string(".alg.");
-	fname += std::to_string(params->kmer_hashing_alg);
+}
+
+// hashes of the kmer2s starting at the positions [start, end) (at most KMER2_BLOCK_SIZE kmers)
+static void hash_kmer2_block(const ref_t& ref, const index_params_t* params, const seq_t start, const seq_t end, char* bases, kmer_cipher_t* hashes) {
+	ref.seq.unpack(start, end - start + params->k2 - 1, bases);
+	hash_kmer2_bases(params, bases, end - start, hashes);
+}
+
+// computes the kmer2 hashes of the positions >= start_pos (the previous positions are kept)
+void compute_kmer2_hashes(ref_t& ref, const index_params_t* params, const seq_t start_pos) {
+	const seq_t n_kmers = ref.len - params->k2 + 1;
+	ref.precomputed_kmer2_hashes.resize(n_kmers);
+	const uint64 n_blocks = (n_kmers > start_pos) ? ((uint64) n_kmers - start_pos + KMER2_BLOCK_SIZE - 1) / KMER2_BLOCK_SIZE : 0;
+	#pragma omp parallel
+	{
+	std::vector<char> bases(KMER2_BLOCK_SIZE + params->k2);
+	#pragma omp for schedule(dynamic)
+	for (uint64 b = 0; b < n_blocks; b++) {
+		const seq_t block_start = start_pos + b*KMER2_BLOCK_SIZE;
+		const seq_t block_end = std::min((uint64) n_kmers, (uint64) block_start + KMER2_BLOCK_SIZE);
+		hash_kmer2_block(ref, params, block_start, block_end, bases.data(), &ref.precomputed_kmer2_hashes[block_start]);
+	}
+	}
+}
+
+// computes the kmer2 ciphers of the valid candidate contigs of the read batch
+// the contig ranges are merged into disjoint ranges, each contig lies within a single range
+void compute_contig_kmer2_ciphers(ref_t& ref, reads_t& reads, const index_params_t* params) {
+	const double start_time = omp_get_wtime();
+	const seq_t n_kmers = ref.len - params->k2 + 1;
+	std::vector<std::pair<seq_t, seq_t> > ranges;
+	for(uint32 i = 0; i < reads.reads.size(); i++) {
+		read_t& r = reads.reads[i];
+		if(!r.is_valid()) continue;
+		for(uint32 j = 0; j < r.ref_matches.size(); j++) {
+			const ref_match_t& m = r.ref_matches[j];
+			const int n_contig_kmers = get_n_kmers(m.len, params->k2);
+			if(!m.valid || n_contig_kmers <= 0 || m.pos >= n_kmers) continue;
+			ranges.push_back(std::make_pair(m.pos, (seq_t) std::min((uint64) n_kmers, (uint64) m.pos + n_contig_kmers)));
+		}
+	}
+	std::sort(ranges.begin(), ranges.end());
+
+	kmer2_ciphers_t& c = ref.kmer2_ciphers;
+	c.range_starts.clear();
+	c.range_ends.clear();
+	c.range_offsets.clear();
+	uint64 n_ciphers = 0;
+	for(size_t i = 0; i < ranges.size(); i++) {
+		if(c.range_ends.size() > 0 && ranges[i].first <= c.range_ends.back()) {
+			if(ranges[i].second > c.range_ends.back()) {
+				n_ciphers += ranges[i].second - c.range_ends.back();
+				c.range_ends.back() = ranges[i].second;
+			}
+			continue;
+		}
+		c.range_starts.push_back(ranges[i].first);
+		c.range_ends.push_back(ranges[i].second);
+		c.range_offsets.push_back(n_ciphers);
+		n_ciphers += ranges[i].second - ranges[i].first;
+	}
+	std::vector<std::pair<seq_t, seq_t> >().swap(ranges);
+	c.range_ciphers.resize(n_ciphers);
+
+	// split the ranges into blocks
+	std::vector<std::pair<uint32, seq_t> > blocks; // (range, block start)
+	for(uint32 i = 0; i < c.range_starts.size(); i++) {
+		for(uint64 pos = c.range_starts[i]; pos < c.range_ends[i]; pos += KMER2_BLOCK_SIZE) {
+			blocks.push_back(std::make_pair(i, (seq_t) pos));
+		}
+	}
+	#pragma omp parallel
+	{
+	std::vector<char> bases(KMER2_BLOCK_SIZE + params->k2);
+	#pragma omp for schedule(dynamic)
+	for (uint64 b = 0; b < blocks.size(); b++) {
+		const uint32 i = blocks[b].first;
+		const seq_t block_start = blocks[b].second;
+		const seq_t block_end = std::min((uint64) c.range_ends[i], (uint64) block_start + KMER2_BLOCK_SIZE);
+		hash_kmer2_block(ref, params, block_start, block_end, bases.data(), &c.range_ciphers[c.range_offsets[i] + (block_start - c.range_starts[i])]);
+	}
+	}
+	printf("Computed the kmer2 ciphers of %llu positions in %zu contig ranges (%.2f MB). Time: %.2f sec\n",
+			n_ciphers, c.range_starts.size(), (double) c.range_bytes()/(1 << 20), omp_get_wtime() - start_time);
+}
+
+void store_kmer2_hashes(const char* refFname, const ref_t& ref, const index_params_t* params) {
+	std::string fname = get_kmer2_hashes_fname(refFname, params);
 	std::ofstream file;
 	file.open(fname.c_str(), std::ios::out | std::ios::binary);
 	if (!file.is_open()) {
 		printf("compute_store_k2_hashes: Cannot open the file %s!\n", fname.c_str());
 		exit(1);
 	}
-	for (uint32 i = 0; i < ref.len - params->k2 + 1; i++) {
-		file.write(reinterpret_cast<char*>(&ref.precomputed_kmer2_hashes[i]), sizeof(ref.precomputed_kmer2_hashes[i]));
+	file.write(reinterpret_cast<const char*>(ref.precomputed_kmer2_hashes.data()), (ref.len - params->k2 + 1)*sizeof(ref.precomputed_kmer2_hashes[0]));
+	if(!file) {
+		printf("compute_store_k2_hashes: Error writing the file %s!\n", fname.c_str());
+		exit(1);
 	}
 	file.close();
 }
 
-void compute_store_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params) {
-	ref.precomputed_neighbor_repeats.resize(ref.len - params->k2 + 1);
-	#pragma omp parallel for
-	for (seq_t i = 0; i < ref.len - params->k2 + 1; i++) {
-		uint64 k = ref.precomputed_kmer2_hashes[i];
-		for(seq_t j = 1; j < MAX_LOC_LEN; j++) {
-			if((i+j) == ref.precomputed_kmer2_hashes.size()) break;
-			if(k == ref.precomputed_kmer2_hashes[i + j]) {
-				ref.precomputed_neighbor_repeats[i] = j;
-				break;
+void compute_store_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params) {
+	compute_kmer2_hashes(ref, params, 0);
+	store_kmer2_hashes(refFname, ref, params);
+}
+
+// computes the distance to the next kmer2 repeat for the positions >= start_pos and the contig repeat mask
+// the (hash, pos) pairs are bucketed by the top REPEAT_PREFIX_BITS bits of the hash (in position order),
+// and each bucket is scanned backwards with a small hash table holding the next occurrence of each hash
+// distances >= MAX_LOC_LEN are stored as 0 (no repeat)
+#define REPEAT_PREFIX_BITS 16
+struct kmer2_occ_t {
+	uint64 hash;
+	seq_t pos;
+};
+
+void compute_repeat_info(ref_t& ref, const index_params_t* params, const seq_t start_pos) {
+	const double start_time = omp_get_wtime();
+	const seq_t n_kmers = ref.len - params->k2 + 1;
+	ref.precomputed_neighbor_repeats.resize(n_kmers);
+	std::fill(ref.precomputed_neighbor_repeats.begin() + std::min(start_pos, n_kmers), ref.precomputed_neighbor_repeats.end(), 0);
+	const uint64* hashes = ref.precomputed_kmer2_hashes.data();
+	const uint32 n_prefixes = 1 << REPEAT_PREFIX_BITS;
+	const uint32 n_slices = params->n_threads;
+	const seq_t n_occs = (n_kmers > start_pos) ? n_kmers - start_pos : 0;
+	auto slice_start = [&](const uint32 s) { return (seq_t) (start_pos + (uint64) n_occs*s/n_slices); };
+
+	// 1. count the kmer2s of each prefix in each slice
+	std::vector<uint32> slice_counts((uint64) n_slices*n_prefixes);
+	#pragma omp parallel for schedule(static, 1)
+	for(uint32 s = 0; s < n_slices; s++) {
+		uint32* counts = &slice_counts[(uint64) s*n_prefixes];
+		for(seq_t pos = slice_start(s); pos < slice_start(s + 1); pos++) {
+			counts[hashes[pos] >> (64 - REPEAT_PREFIX_BITS)]++;
+		}
+	}
+	std::vector<uint64> prefix_counts(n_prefixes);
+	for(uint32 p = 0; p < n_prefixes; p++) {
+		for(uint32 s = 0; s < n_slices; s++) {
+			prefix_counts[p] += slice_counts[(uint64) s*n_prefixes + p];
+		}
+	}
+
+	// 2. split the prefixes into ranges within the memory budget
+	const uint64 max_range_occs = (params->mem_budget > 0) ? std::max((uint64) 1, params->mem_budget/sizeof(kmer2_occ_t)) : UINT64_MAX;
+	std::vector<uint32> range_starts(1, 0);
+	uint64 range_occs = 0;
+	uint64 max_range_size = 0;
+	for(uint32 p = 0; p < n_prefixes; p++) {
+		if(range_occs > 0 && range_occs + prefix_counts[p] > max_range_occs) {
+			range_starts.push_back(p);
+			range_occs = 0;
+		}
+		range_occs += prefix_counts[p];
+		max_range_size = std::max(max_range_size, range_occs);
+	}
+	range_starts.push_back(n_prefixes);
+
+	std::vector<kmer2_occ_t> occs(max_range_size);
+	std::vector<uint64> group_offsets(n_prefixes + 1);
+	std::vector<uint64> slice_offsets((uint64) n_slices*n_prefixes);
+	for(uint32 r = 0; r + 1 < range_starts.size(); r++) {
+		const uint32 first_prefix = range_starts[r];
+		const uint32 last_prefix = range_starts[r + 1];
+		// 3. offset of each prefix group and of each slice in the group
+		uint64 offset = 0;
+		for(uint32 p = first_prefix; p < last_prefix; p++) {
+			group_offsets[p] = offset;
+			for(uint32 s = 0; s < n_slices; s++) {
+				slice_offsets[(uint64) s*n_prefixes + p] = offset;
+				offset += slice_counts[(uint64) s*n_prefixes + p];
+			}
+		}
+		group_offsets[last_prefix] = offset;
+
+		// 4. scatter the pairs of the range
+		#pragma omp parallel for schedule(static, 1)
+		for(uint32 s = 0; s < n_slices; s++) {
+			uint64* offsets = &slice_offsets[(uint64) s*n_prefixes];
+			for(seq_t pos = slice_start(s); pos < slice_start(s + 1); pos++) {
+				const uint32 p = hashes[pos] >> (64 - REPEAT_PREFIX_BITS);
+				if(p >= first_prefix && p < last_prefix) {
+					kmer2_occ_t& occ = occs[offsets[p]++];
+					occ.hash = hashes[pos];
+					occ.pos = pos;
+				}
+			}
+		}
+
+		// 5. link the consecutive occurrences of each prefix group
+		#pragma omp parallel
+		{
+		std::vector<kmer2_occ_t> next_occ;
+		#pragma omp for schedule(dynamic, 64)
+		for(uint32 p = first_prefix; p < last_prefix; p++) {
+			const kmer2_occ_t* group = &occs[group_offsets[p]];
+			const uint64 size = group_offsets[p + 1] - group_offsets[p];
+			uint64 n_slots = 16;
+			while(n_slots < 2*size) n_slots <<= 1;
+			kmer2_occ_t empty;
+			empty.hash = 0;
+			empty.pos = UINT32_MAX;
+			next_occ.assign(n_slots, empty);
+			for(uint64 i = size; i-- > 0; ) {
+				uint64 slot = group[i].hash & (n_slots - 1);
+				while(next_occ[slot].pos != UINT32_MAX && next_occ[slot].hash != group[i].hash) {
+					slot = (slot + 1) & (n_slots - 1);
+				}
+				if(next_occ[slot].pos != UINT32_MAX && next_occ[slot].pos - group[i].pos < MAX_LOC_LEN) {
+					ref.precomputed_neighbor_repeats[group[i].pos] = next_occ[slot].pos - group[i].pos;
+				}
+				next_occ[slot] = group[i];
 			}
 		}
+		}
 	}
 	compute_ref_repeat_mask(ref);
+	printf("Computed the kmer2 repeats of %u positions in %zu prefix range(s). Time: %.2f sec\n",
+			n_occs, range_starts.size() - 1, omp_get_wtime() - start_time);
+}
 
-	std::string fname(refFname);
-	fname += std::string(".rep.");
-	fname += std::to_string(params->k2);
-	fname += std::to_string(params->kmer_hashing_alg);
+void store_repeat_info(const char* refFname, const ref_t& ref, const index_params_t* params) {
+	std::string fname = get_repeat_info_fname(refFname, params);
 	std::ofstream file;
 	file.open(fname.c_str(), std::ios::out | std::ios::binary);
 	if (!file.is_open()) {
 		printf("compute_store_repeat_info: Cannot open the file %s!\n", fname.c_str());
 		exit(1);
 	}
-	for (uint32 i = 0; i < ref.len - params->k2 + 1; i++) {
-		file.write(reinterpret_cast<char*>(&ref.precomputed_neighbor_repeats[i]), sizeof(ref.precomputed_neighbor_repeats[i]));
+	file.write(reinterpret_cast<const char*>(ref.precomputed_neighbor_repeats.data()), (ref.len - params->k2 + 1)*sizeof(ref.precomputed_neighbor_repeats[0]));
+	file.write(reinterpret_cast<const char*>(&ref.contig_mask[0]), ref.contig_mask.size()*sizeof(ref.contig_mask[0]));
+	if(!file) {
+		printf("compute_store_repeat_info: Error writing the file %s!\n", fname.c_str());
+		exit(1);
 	}
-	file.write(reinterpret_cast<char*>(&ref.contig_mask[0]), ref.contig_mask.size()*sizeof(ref.contig_mask[0]));
-
 	file.close();
 }
 
+void compute_store_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params) {
+	compute_repeat_info(ref, params, 0);
+	store_repeat_info(refFname, ref, params);
+}
+
 /*void compute_store_repeat_local(const char* refFname, ref_t& ref, const index_params_t* params) {
         std::string fname(refFname);
         fname += std::string(".local_rep_map.");
@@ -264,11 +786,7 @@ void compute_store_repeat_info(const char* refFname, ref_t& ref, const index_par
 }*/
 
 bool load_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".hash.");
-	fname += std::to_string(params->k2);
-	fname += std::string(".alg.");
-	fname += std::to_string(params->kmer_hashing_alg);
+	std::string fname = get_kmer2_hashes_fname(refFname, params);
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
 	if (!file.is_open()) {
@@ -280,42 +798,39 @@ bool load_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* p
 	return true;
 }
 
-void store_ref_idx_flat(const char* refFname, const ref_t& ref, const index_params_t* params) {
+// window mask file name: <ref>.window_mask.<w>
+std::string get_window_mask_fname(const char* refFname, const index_params_t* params) {
 	std::string fname(refFname);
-	fname += std::string(".idx_flat.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
+	fname += std::string(".window_mask.");
 	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-    fname += std::to_string(params->n_buckets_pow2);
-    fname += std::string("_k");
-    fname += std::to_string(params->k);
-    fname += std::string("_H");
-    fname += std::to_string(params->max_count);
+	return fname;
+}
 
-	std::ofstream file;
-	file.open(fname.c_str(), std::ios::out | std::ios::binary);
-	if (!file.is_open()) {
-		printf("store_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
-		exit(1);
-	}
+// kmer2 hashes file name: <ref>.hash.<k2>.alg.<V>
+std::string get_kmer2_hashes_fname(const char* refFname, const index_params_t* params) {
+	std::string fname(refFname);
+	fname += std::string(".hash.");
+	fname += std::to_string(params->k2);
+	fname += std::string(".alg.");
+	fname += std::to_string(params->kmer_hashing_alg);
+	return fname;
+}
 
-	uint64 total_num_entries = ref.index.buckets_data.size();
-	file.write(reinterpret_cast<char*>(&total_num_entries), sizeof(total_num_entries));
-	file.write(reinterpret_cast<const char*>(&ref.index.buckets_data[0]), total_num_entries*sizeof(loc_t));
-	file.write(reinterpret_cast<const char*>(&ref.index.bucket_offsets[0]), (params->n_tables*params->n_buckets+1)*sizeof(uint64));
-	file.close();
+// kmer2 repeats file name: <ref>.rep.<k2><V>
+std::string get_repeat_info_fname(const char* refFname, const index_params_t* params) {
+	std::string fname(refFname);
+	fname += std::string(".rep.");
+	fname += std::to_string(params->k2);
+	fname += std::to_string(params->kmer_hashing_alg);
+	return fname;
 }
 
-void load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* params) {
+// index file name: <ref>.<ext>.h<h>_T<T>_b<b>_w<w>_p<p|auto>_k<k>_H<H>
+std::string get_ref_idx_fname(const char* refFname, const char* ext, const index_params_t* params) {
 	std::string fname(refFname);
-	fname += std::string(".idx_flat.");
-	fname += std::string("h");
+	fname += std::string(".");
+	fname += std::string(ext);
+	fname += std::string(".h");
 	fname += std::to_string(params->h);
 	fname += std::string("_T");
 	fname += std::to_string(params->n_tables);
@@ -324,47 +839,676 @@ void load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* p
 	fname += std::string("_w");
 	fname += std::to_string(params->ref_window_size);
 	fname += std::string("_p");
-	fname += std::to_string(params->n_buckets_pow2);
+	fname += params->auto_n_buckets ? std::string("auto") : std::to_string(params->n_buckets_pow2);
 	fname += std::string("_k");
 	fname += std::to_string(params->k);
 	fname += std::string("_H");
 	fname += std::to_string(params->max_count);
+	if(params->ref_window_stride > 1) {
+		fname += std::string("_s");
+		fname += std::to_string(params->ref_window_stride);
+	}
+	return fname;
+}
+
+static inline uint64 align_file_offset(const uint64 offset) {
+	return (offset + IDX_FLAT_ALIGN - 1) / IDX_FLAT_ALIGN * IDX_FLAT_ALIGN;
+}
+
+static void write_file_padding(std::ofstream& file, const uint64 offset) {
+	static const char zeros[IDX_FLAT_ALIGN] = { 0 };
+	const uint64 pos = file.tellp();
+	file.write(zeros, offset - pos);
+}
+
+// header of a raw (loc_t entries) flat index with the given number of entries
+void init_ref_idx_flat_header(idx_flat_header_t& header, const uint64 n_entries, const uint32 dir_rel_bits, const seq_t ref_len, const index_params_t* params) {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IDX_FLAT_MAGIC, sizeof(header.magic));
+	header.version = IDX_FLAT_VERSION;
+	header.loc_size = sizeof(loc_t);
+	header.h = params->h;
+	header.n_tables = params->n_tables;
+	header.sketch_proj_len = params->sketch_proj_len;
+	header.ref_window_size = params->ref_window_size;
+	header.ref_window_stride = params->ref_window_stride;
+	header.n_buckets_pow2 = params->n_buckets_pow2;
+	header.k = params->k;
+	header.max_count = params->max_count;
+	header.ref_len = ref_len;
+	header.entry_encoding = ENTRY_RAW;
+	header.n_entries = n_entries;
+	header.n_offsets = (uint64) params->n_tables*params->n_buckets + 1;
+	header.dir_block_bits = std::min((uint32) BUCKET_DIR_BLOCK_BITS, params->n_buckets_pow2);
+	header.dir_rel_bits = dir_rel_bits;
+	header.max_bucket_size = params->max_bucket_size;
+	const uint64 n_blocks = ((header.n_offsets - 1) >> header.dir_block_bits) + 1;
+	header.offsets_file_offset = align_file_offset(sizeof(header));
+	header.dir_rel_file_offset = align_file_offset(header.offsets_file_offset + n_blocks*sizeof(uint64));
+	header.entries_file_offset = align_file_offset(header.dir_rel_file_offset + header.n_offsets*dir_rel_bits/8);
+	header.entries_bytes = n_entries*sizeof(loc_t);
+}
 
+// splits the bucket offsets into the block bases and relative offsets of the bucket directory
+// (offsets must start at a block boundary, BUCKET_SKIP_FLAG becomes the top bit of the relative offset)
+void compact_bucket_offsets(const uint64* offsets, const uint64 n_buckets, const uint32 block_bits, const uint32 rel_bits,
+		uint64* bases, void* rel) {
+	const uint64 max_rel = (1ULL << (rel_bits - 1)) - 1;
+	for(uint64 i = 0; i < n_buckets; i++) {
+		const uint64 offset = offsets[i] & ~BUCKET_SKIP_FLAG;
+		if((i & ((1ULL << block_bits) - 1)) == 0) {
+			bases[i >> block_bits] = offset;
+		}
+		uint64 r = offset - bases[i >> block_bits];
+		if(r > max_rel) {
+			printf("compact_bucket_offsets: Bucket block too large for %u-bit relative offsets!\n", rel_bits);
+			exit(1);
+		}
+		if(offsets[i] & BUCKET_SKIP_FLAG) {
+			r |= max_rel + 1;
+		}
+		if(rel_bits == 16) {
+			((uint16_t*) rel)[i] = r;
+		} else {
+			((uint32*) rel)[i] = r;
+		}
+	}
+}
+
+// writes the directory of table t given its absolute bucket offsets (32-bit relative offsets)
+// (the directory entry of the end sentinel is written with the offsets of the last table)
+void store_bucket_directory(const int fd, const idx_flat_header_t& header, const uint32 t, const std::vector<uint64>& table_offsets) {
+	const uint64 n_buckets = table_offsets.size();
+	const uint64 first_bucket = t*n_buckets;
+	std::vector<uint64> bases((n_buckets >> header.dir_block_bits) + 1);
+	std::vector<uint32> rel(n_buckets + 1);
+	compact_bucket_offsets(table_offsets.data(), n_buckets, header.dir_block_bits, 32, bases.data(), rel.data());
+	const bool last = first_bucket + n_buckets + 1 == header.n_offsets;
+	if(last) {
+		bases[n_buckets >> header.dir_block_bits] = header.n_entries;
+		rel[n_buckets] = 0;
+	}
+	write_file_at(fd, bases.data(), ((n_buckets >> header.dir_block_bits) + (last ? 1 : 0))*sizeof(uint64),
+			header.offsets_file_offset + (first_bucket >> header.dir_block_bits)*sizeof(uint64));
+	write_file_at(fd, rel.data(), (n_buckets + (last ? 1 : 0))*sizeof(uint32),
+			header.dir_rel_file_offset + first_bucket*sizeof(uint32));
+}
+
+// store the sorted index in CSR form (see idx_flat_header_t)
+void store_ref_idx_flat(const char* refFname, const ref_t& ref, const index_params_t* params) {
+	// written to a temporary file first (the current index file may be mapped)
+	std::string fname = get_ref_idx_fname(refFname, "idx_flat", params);
+	std::string tmp_fname = fname + std::string(".tmp");
+	std::ofstream file;
+	file.open(tmp_fname.c_str(), std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		printf("store_ref_idx_flat: Cannot open the IDX file %s!\n", tmp_fname.c_str());
+		exit(1);
+	}
+
+	idx_flat_header_t header;
+	init_ref_idx_flat_header(header, ref.index.n_entries, ref.index.dir_rel_bits, ref.len, params);
+	header.entry_encoding = ref.index.encoding;
+	header.pos_bits = ref.index.pos_bits;
+	header.len_bits = ref.index.len_bits;
+	header.entry_bits = ref.index.entry_bits;
+	header.entries_bytes = ref.index.entries_bytes();
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	write_file_padding(file, header.offsets_file_offset);
+	file.write(reinterpret_cast<const char*>(ref.index.dir_bases), (((header.n_offsets - 1) >> header.dir_block_bits) + 1)*sizeof(uint64));
+	write_file_padding(file, header.dir_rel_file_offset);
+	file.write(reinterpret_cast<const char*>(ref.index.dir_rel), header.n_offsets*header.dir_rel_bits/8);
+	write_file_padding(file, header.entries_file_offset);
+	if(ref.index.encoding == ENTRY_RAW) {
+		file.write(reinterpret_cast<const char*>(ref.index.entries), header.entries_bytes);
+	} else {
+		file.write(reinterpret_cast<const char*>(ref.index.packed), header.entries_bytes);
+	}
+	if(!file) {
+		printf("store_ref_idx_flat: Error writing the IDX file %s!\n", tmp_fname.c_str());
+		exit(1);
+	}
+	file.close();
+	if(rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+		printf("store_ref_idx_flat: Cannot rename the IDX file %s!\n", tmp_fname.c_str());
+		exit(1);
+	}
+}
+
+// bucket exponent recorded in the flat index file
+// returns 0 if the index file does not exist
+uint32 load_ref_idx_flat_buckets_pow2(const char* refFname, const index_params_t* params) {
+	std::string fname = get_ref_idx_fname(refFname, "idx_flat", params);
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
 	if (!file.is_open()) {
-		printf("load_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
-		std::cerr << "Error: " << strerror(errno);
+		return 0;
+	}
+	idx_flat_header_t header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(!file || memcmp(header.magic, IDX_FLAT_MAGIC, sizeof(header.magic)) != 0 || header.version != IDX_FLAT_VERSION) {
+		printf("load_ref_idx_flat_buckets_pow2: Unsupported IDX file format %s (please rebuild the index)!\n", fname.c_str());
 		exit(1);
 	}
+	file.close();
+	return header.n_buckets_pow2;
+}
 
-	uint64 total_num_bucket_entries;
-	file.read(reinterpret_cast<char*>(&total_num_bucket_entries), sizeof(total_num_bucket_entries));
-	ref.index.bucket_offsets.resize(params->n_tables*params->n_buckets+1);
-	ref.index.buckets_data.resize(total_num_bucket_entries);
-	file.read(reinterpret_cast<char*>(&ref.index.buckets_data[0]), total_num_bucket_entries*sizeof(loc_t));
-	file.read(reinterpret_cast<char*>(&ref.index.bucket_offsets[0]), (params->n_tables*params->n_buckets+1)*sizeof(uint64));
+// sink of the pre-fault page touches (-P 2)
+static volatile uint64 prefault_sink;
+
+// checks the flat index image (a mapped index file or a bundle section) against the index parameters
+// and points the index to its sections (the mapping is owned by the caller)
+static void attach_ref_idx_flat(const std::string& fname, const char* image, const uint64 image_len, ref_t& ref, const index_params_t* params) {
+	const idx_flat_header_t* header = (const idx_flat_header_t*) image;
+	if(image_len < sizeof(idx_flat_header_t) || memcmp(header->magic, IDX_FLAT_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != IDX_FLAT_VERSION || header->loc_size != sizeof(loc_t)) {
+		printf("load_ref_idx_flat: Unsupported IDX file format %s (please rebuild the index)!\n", fname.c_str());
+		exit(1);
+	}
+	if(header->h != params->h || header->n_tables != params->n_tables || header->sketch_proj_len != params->sketch_proj_len
+			|| header->ref_window_size != params->ref_window_size || header->ref_window_stride != params->ref_window_stride
+			|| header->n_buckets_pow2 != params->n_buckets_pow2
+			|| header->k != params->k || header->max_count != params->max_count
+			|| header->n_offsets != (uint64) params->n_tables*params->n_buckets + 1
+			|| (header->dir_rel_bits != 16 && header->dir_rel_bits != 32)
+			|| header->entries_file_offset + header->entries_bytes > image_len) {
+		printf("load_ref_idx_flat: IDX file %s does not match the index parameters!\n", fname.c_str());
+		exit(1);
+	}
+
+	ref.index.dir_bases = (const uint64*) (image + header->offsets_file_offset);
+	ref.index.dir_rel = (const void*) (image + header->dir_rel_file_offset);
+	ref.index.dir_block_bits = header->dir_block_bits;
+	ref.index.dir_rel_bits = header->dir_rel_bits;
+	ref.index.n_offsets = header->n_offsets;
+	ref.index.n_entries = header->n_entries;
+	ref.index.ref_len = header->ref_len;
+	ref.index.encoding = header->entry_encoding;
+	if(header->entry_encoding == ENTRY_RAW) {
+		ref.index.entries = (const loc_t*) (image + header->entries_file_offset);
+	} else {
+		ref.index.packed = (const uint64*) (image + header->entries_file_offset);
+		ref.index.n_packed_words = header->entries_bytes/sizeof(uint64);
+		ref.index.n_buckets_pow2 = header->n_buckets_pow2;
+		ref.index.rem_bits = 32 - header->n_buckets_pow2;
+		ref.index.pos_bits = header->pos_bits;
+		ref.index.len_bits = header->len_bits;
+		ref.index.entry_bits = header->entry_bits;
+	}
+	std::cout << "Total number of contig entries in the index: " << ref.index.n_entries << " (" <<
+			(ref.index.n_entries > 0 ? (double) header->entries_bytes/ref.index.n_entries : 0) << " bytes/entry)\n";
+
+	if(params->idx_prefault == PREFAULT_TOUCH) { // fault the pages in parallel
+		const long page_size = sysconf(_SC_PAGESIZE);
+		uint64 sum = 0;
+		#pragma omp parallel for reduction(+:sum)
+		for(uint64 i = 0; i < image_len; i += page_size) {
+			sum += image[i];
+		}
+		prefault_sink = sum; // keep the loads
+	}
+}
+
+// maps the whole file read-only (returns NULL if the file does not exist)
+static void* map_file(const std::string& fname, const char* caller, const bool populate, uint64& len) {
+	int fd = open(fname.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		printf("%s: Invalid file %s!\n", caller, fname.c_str());
+		exit(1);
+	}
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if(populate) {
+		flags |= MAP_POPULATE;
+	}
+#endif
+	void* addr = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED) {
+		printf("%s: Cannot map the file %s!\n", caller, fname.c_str());
+		std::cerr << "Error: " << strerror(errno) << "\n";
+		exit(1);
+	}
+	len = st.st_size;
+	return addr;
+}
+
+// maps the bytes [offset, offset + bytes) of the file read-only (from the enclosing page)
+// returns the mapping (map_len bytes) and sets data to the first byte of the range
+static void* map_file_range(const std::string& fname, const char* caller, const bool populate, const uint64 offset, const uint64 bytes,
+		uint64& map_len, const char*& data) {
+	const uint64 page_size = sysconf(_SC_PAGESIZE);
+	const uint64 map_offset = offset/page_size*page_size;
+	int fd = open(fname.c_str(), O_RDONLY);
+	if(fd < 0) {
+		printf("%s: Cannot open the file %s!\n", caller, fname.c_str());
+		exit(1);
+	}
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if(populate) {
+		flags |= MAP_POPULATE;
+	}
+#endif
+	map_len = offset + bytes - map_offset;
+	void* addr = mmap(NULL, map_len, PROT_READ, flags, fd, map_offset);
+	close(fd);
+	if(addr == MAP_FAILED) {
+		printf("%s: Cannot map the file %s!\n", caller, fname.c_str());
+		std::cerr << "Error: " << strerror(errno) << "\n";
+		exit(1);
+	}
+	data = (const char*) addr + (offset - map_offset);
+	return addr;
+}
+
+// maps the precomputed kmer2 hashes file (only the pages of the candidate contigs are read)
+// returns false if the hashes file does not exist
+bool map_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params) {
+	std::string fname = get_kmer2_hashes_fname(refFname, params);
+	uint64 len;
+	void* addr = map_file(fname, "map_kmer2_hashes", false, len);
+	if(addr == NULL) {
+		return false;
+	}
+	if(len != (ref.len - params->k2 + 1)*sizeof(kmer_cipher_t)) {
+		printf("map_kmer2_hashes: The hashes file %s does not match the reference, please rebuild it!\n", fname.c_str());
+		exit(1);
+	}
+	madvise(addr, len, MADV_RANDOM); // (scattered contig lookups)
+	ref.kmer2_ciphers.release();
+	ref.kmer2_ciphers.mapped_addr = addr;
+	ref.kmer2_ciphers.mapped_len = len;
+	ref.kmer2_ciphers.all_hashes = (const kmer_cipher_t*) addr;
+	return true;
+}
+
+// map the flat index file (read-only, shared across processes through the page cache)
+// the index entries and offsets become views into the mapping
+// returns false if the index file does not exist
+bool load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* params) {
+	std::string fname = get_ref_idx_fname(refFname, "idx_flat", params);
+	uint64 len;
+	void* addr = map_file(fname, "load_ref_idx_flat", params->idx_prefault == PREFAULT_POPULATE, len);
+	if(addr == NULL) {
+		return false;
+	}
+	ref.index.release();
+	ref.index.mapped_addr = addr;
+	ref.index.mapped_len = len;
+	attach_ref_idx_flat(fname, (const char*) addr, len, ref, params);
+	return true;
+}
+
+// --- reference bundle (see ref_bundle_header_t) ---
+
+// 64-bit checksum of a byte array: the blocks are hashed in parallel (4 multiply-xor lanes per block)
+// and the block checksums are combined in order, so the result does not depend on the number of threads
+#define CHECKSUM_BLOCK_SIZE (1 << 20)
+#define CHECKSUM_PRIME 0x100000001b3ULL
+#define CHECKSUM_OFFSET 0xcbf29ce484222325ULL
+static uint64 checksum_bytes(const void* data, const uint64 n_bytes) {
+	const char* bytes = (const char*) data;
+	const uint64 n_blocks = (n_bytes + CHECKSUM_BLOCK_SIZE - 1)/CHECKSUM_BLOCK_SIZE;
+	std::vector<uint64> block_checksums(n_blocks);
+	#pragma omp parallel for
+	for(uint64 b = 0; b < n_blocks; b++) {
+		const char* block = bytes + b*CHECKSUM_BLOCK_SIZE;
+		const uint64 len = std::min((uint64) CHECKSUM_BLOCK_SIZE, n_bytes - b*CHECKSUM_BLOCK_SIZE);
+		const uint64 n_words = len/sizeof(uint64);
+		uint64 lanes[4] = {CHECKSUM_OFFSET, CHECKSUM_OFFSET + 1, CHECKSUM_OFFSET + 2, CHECKSUM_OFFSET + 3};
+		uint64 i = 0;
+		for(; i + 4 <= n_words; i += 4) {
+			for(uint32 j = 0; j < 4; j++) {
+				uint64 w;
+				memcpy(&w, block + (i + j)*sizeof(uint64), sizeof(w));
+				lanes[j] = (lanes[j] ^ w)*CHECKSUM_PRIME;
+			}
+		}
+		for(uint32 j = 0; i < n_words; i++, j++) {
+			uint64 w;
+			memcpy(&w, block + i*sizeof(uint64), sizeof(w));
+			lanes[j] = (lanes[j] ^ w)*CHECKSUM_PRIME;
+		}
+		uint64 tail = 0;
+		memcpy(&tail, block + n_words*sizeof(uint64), len % sizeof(uint64));
+		uint64 h = (lanes[0] ^ tail)*CHECKSUM_PRIME;
+		for(uint32 j = 1; j < 4; j++) {
+			h = (h ^ (h >> 29) ^ lanes[j])*CHECKSUM_PRIME;
+		}
+		block_checksums[b] = h;
+	}
+	uint64 h = CHECKSUM_OFFSET ^ n_bytes;
+	for(uint64 b = 0; b < n_blocks; b++) {
+		h = (h ^ (h >> 29) ^ block_checksums[b])*CHECKSUM_PRIME;
+	}
+	return h ^ (h >> 32);
+}
+
+static uint64 ref_seq_checksum(const ref_t& ref) {
+	uint64 h = checksum_bytes(ref.seq.words.data(), ref.seq.words.size()*sizeof(uint64));
+	h = (h ^ checksum_bytes(ref.seq.n_runs.data(), ref.seq.n_runs.size()*sizeof(ref.seq.n_runs[0])))*CHECKSUM_PRIME;
+	return h ^ ref.len;
+}
+
+// the random coefficients of the minhash and sketch projection hash functions
+static void get_hash_function_seeds(const index_params_t* params, std::vector<uint64>& seeds) {
+	for(uint32 f = 0; f < params->minhash_functions.size(); f++) {
+		seeds.push_back(params->minhash_functions[f].a);
+	}
+	for(uint32 i = 0; i < params->sketch_proj_hash_func.a_vec.size(); i++) {
+		seeds.push_back(params->sketch_proj_hash_func.a_vec[i]);
+	}
+	for(uint32 i = 0; i < params->sketch_proj_indices.size(); i++) {
+		seeds.push_back(params->sketch_proj_indices[i]);
+	}
+}
+
+static std::string get_ref_bundle_fname(const char* refFname) {
+	return std::string(refFname) + std::string(".bundle");
+}
+
+// stores the loaded reference data (the index must be mapped from its flat file)
+void store_ref_bundle(const char* refFname, const ref_t& ref, const index_params_t* params) {
+	if(ref.index.mapped_addr == NULL) {
+		printf("store_ref_bundle: The reference index is not loaded from a flat index file!\n");
+		exit(1);
+	}
+	std::vector<uint64> seeds;
+	get_hash_function_seeds(params, seeds);
+	const void* section_data[] = {seeds.data(), ref.high_freq_kmers.prefix_offsets, ref.high_freq_kmers.suffixes,
+		ref.ignore_window_bitmask.words.data(), ref.precomputed_kmer2_hashes.data(), ref.precomputed_neighbor_repeats.data(),
+		ref.index.mapped_addr};
+	const uint64 section_bytes[] = {seeds.size()*sizeof(uint64), ref.high_freq_kmers.n_prefix_offsets*sizeof(uint32),
+		ref.high_freq_kmers.n_suffixes*sizeof(uint16_t), ref.ignore_window_bitmask.words.size()*sizeof(uint64),
+		ref.precomputed_kmer2_hashes.size()*sizeof(kmer_cipher_t), ref.precomputed_neighbor_repeats.size()*sizeof(uint16_t),
+		ref.index.mapped_len};
+	const uint32 section_types[] = {BUNDLE_HASH_FUNCTIONS, BUNDLE_FREQ_KMER_OFFSETS, BUNDLE_FREQ_KMER_SUFFIXES,
+		BUNDLE_WINDOW_MASK, BUNDLE_KMER2_HASHES, BUNDLE_KMER2_REPEATS, BUNDLE_INDEX};
+	const uint32 n_sections = sizeof(section_types)/sizeof(section_types[0]);
+
+	ref_bundle_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, REF_BUNDLE_MAGIC, sizeof(header.magic));
+	header.version = REF_BUNDLE_VERSION;
+	header.n_sections = n_sections;
+	header.h = params->h;
+	header.n_tables = params->n_tables;
+	header.sketch_proj_len = params->sketch_proj_len;
+	header.ref_window_size = params->ref_window_size;
+	header.ref_window_stride = params->ref_window_stride;
+	header.n_buckets_pow2 = params->n_buckets_pow2;
+	header.k = params->k;
+	header.k2 = params->k2;
+	header.kmer_hashing_alg = params->kmer_hashing_alg;
+	header.entry_encoding = ref.index.encoding;
+	header.max_bucket_size = params->max_bucket_size;
+	header.max_matched_contig_len = params->max_matched_contig_len;
+	header.max_count = params->max_count;
+	header.ref_len = ref.len;
+	header.ref_checksum = ref_seq_checksum(ref);
+	uint64 offset = (sizeof(header) + IDX_FLAT_ALIGN - 1)/IDX_FLAT_ALIGN*IDX_FLAT_ALIGN;
+	for(uint32 i = 0; i < n_sections; i++) {
+		header.sections[i].type = section_types[i];
+		header.sections[i].file_offset = offset;
+		header.sections[i].bytes = section_bytes[i];
+		header.sections[i].checksum = checksum_bytes(section_data[i], section_bytes[i]);
+		offset += (section_bytes[i] + IDX_FLAT_ALIGN - 1)/IDX_FLAT_ALIGN*IDX_FLAT_ALIGN;
+	}
+	header.header_checksum = checksum_bytes(&header, offsetof(ref_bundle_header_t, header_checksum));
+
+	// written to a temporary file first (the current bundle may be mapped)
+	std::string fname = get_ref_bundle_fname(refFname);
+	std::string tmp_fname = fname + std::string(".tmp");
+	std::ofstream file;
+	file.open(tmp_fname.c_str(), std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		printf("store_ref_bundle: Cannot open the bundle file %s!\n", tmp_fname.c_str());
+		exit(1);
+	}
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	for(uint32 i = 0; i < n_sections; i++) {
+		write_file_padding(file, header.sections[i].file_offset);
+		file.write(reinterpret_cast<const char*>(section_data[i]), section_bytes[i]);
+	}
+	write_file_padding(file, offset);
+	if(!file) {
+		printf("store_ref_bundle: Error writing the bundle file %s!\n", tmp_fname.c_str());
+		exit(1);
+	}
+	file.close();
+	if(rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+		printf("store_ref_bundle: Cannot rename the bundle file %s!\n", tmp_fname.c_str());
+		exit(1);
+	}
+	printf("Stored the reference bundle %s (%.2f MB)\n", fname.c_str(), (double) offset/(1 << 20));
+}
+
+static void check_bundle_param(const std::string& fname, const char* name, const uint64 bundle_value, const uint64 value) {
+	if(bundle_value != value) {
+		printf("load_ref_bundle: Bundle %s was built with %s = %llu (current: %llu), please rebuild it!\n",
+				fname.c_str(), name, bundle_value, value);
+		exit(1);
+	}
+}
+
+// the section of the given type
+static const ref_bundle_section_t& find_bundle_section(const std::string& fname, const ref_bundle_header_t& header, const uint32 type) {
+	for(uint32 i = 0; i < header.n_sections; i++) {
+		if(header.sections[i].type == type) {
+			return header.sections[i];
+		}
+	}
+	printf("load_ref_bundle: Section %u is missing from the bundle %s, please rebuild it!\n", type, fname.c_str());
+	exit(1);
+}
+
+// maps the section (checked against its checksum if verify is set), the mapping is kept until the end of the run
+static const char* map_bundle_section(const std::string& fname, const ref_bundle_section_t& section, const bool populate,
+		const bool verify, ref_t& ref) {
+	uint64 map_len;
+	const char* data;
+	void* addr = map_file_range(fname, "load_ref_bundle", populate, section.file_offset, section.bytes, map_len, data);
+	ref.bundle.mappings.push_back(std::make_pair(addr, (size_t) map_len));
+	if(verify && checksum_bytes(data, section.bytes) != section.checksum) {
+		printf("load_ref_bundle: Section %u of the bundle %s is corrupted, please rebuild it!\n", section.type, fname.c_str());
+		exit(1);
+	}
+	return data;
+}
+
+// maps the index section for the current read batch (released with the index)
+static void map_bundle_index(const std::string& fname, ref_t& ref, const index_params_t* params) {
+	uint64 map_len;
+	const char* data;
+	void* addr = map_file_range(fname, "load_ref_bundle", params->idx_prefault == PREFAULT_POPULATE,
+			ref.bundle.index_offset, ref.bundle.index_bytes, map_len, data);
+	ref.index.release();
+	ref.index.mapped_addr = addr;
+	ref.index.mapped_len = map_len;
+	attach_ref_idx_flat(fname, data, ref.bundle.index_bytes, ref, params);
+}
+
+// loads the reference data from the bundle of the reference (the reference sequence must be loaded)
+// the first call checks the bundle and maps the sections used by the queries (each section is verified once
+// and used in place), the next read batches only map the index section again (released after the candidate contigs)
+// the kmer2 hashes are mapped in the KMER2_LOAD (populated and verified) and KMER2_MAP modes,
+// the index (and the bucket exponent) only with a MinHash index lookup (load_mhi)
+// returns false if the bundle does not exist
+bool load_ref_bundle(const char* refFname, ref_t& ref, const index_params_t* params) {
+	std::string fname = get_ref_bundle_fname(refFname);
+	if(ref.bundle.loaded) {
+		if(params->load_mhi) {
+			map_bundle_index(fname, ref, params);
+		}
+		return true;
+	}
+	std::ifstream file;
+	file.open(fname.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	ref_bundle_header_t header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	const bool header_read = (bool) file;
+	file.seekg(0, std::ios::end);
+	const uint64 len = file.tellg();
 	file.close();
+	bool valid = header_read && memcmp(header.magic, REF_BUNDLE_MAGIC, sizeof(header.magic)) == 0
+			&& header.version == REF_BUNDLE_VERSION && header.n_sections <= REF_BUNDLE_MAX_SECTIONS
+			&& header.header_checksum == checksum_bytes(&header, offsetof(ref_bundle_header_t, header_checksum));
+	for(uint32 i = 0; valid && i < header.n_sections; i++) {
+		valid = header.sections[i].file_offset % IDX_FLAT_ALIGN == 0 && header.sections[i].bytes > 0
+				&& header.sections[i].file_offset + header.sections[i].bytes <= len;
+	}
+	if(!valid) {
+		printf("load_ref_bundle: Unsupported or corrupted bundle file %s, please rebuild it!\n", fname.c_str());
+		exit(1);
+	}
+	check_bundle_param(fname, "h", header.h, params->h);
+	check_bundle_param(fname, "T", header.n_tables, params->n_tables);
+	check_bundle_param(fname, "b", header.sketch_proj_len, params->sketch_proj_len);
+	check_bundle_param(fname, "w", header.ref_window_size, params->ref_window_size);
+	check_bundle_param(fname, "stride", header.ref_window_stride, params->ref_window_stride);
+	if(params->load_mhi) { // (the sketch projections do not depend on the bucket count)
+		check_bundle_param(fname, "p", header.n_buckets_pow2, params->n_buckets_pow2);
+	}
+	check_bundle_param(fname, "k", header.k, params->k);
+	check_bundle_param(fname, "v", header.k2, params->k2);
+	check_bundle_param(fname, "kmer2 hashing algorithm (-V)", header.kmer_hashing_alg, params->kmer_hashing_alg);
+	check_bundle_param(fname, "H", header.max_count, params->max_count);
+	if(header.ref_len != ref.len || header.ref_checksum != ref_seq_checksum(ref)) {
+		printf("load_ref_bundle: Bundle %s was built for a different reference sequence, please rebuild it!\n", fname.c_str());
+		exit(1);
+	}
+	std::vector<uint64> seeds;
+	get_hash_function_seeds(params, seeds);
+	const ref_bundle_section_t& seeds_section = find_bundle_section(fname, header, BUNDLE_HASH_FUNCTIONS);
+	const char* data = map_bundle_section(fname, seeds_section, false, true, ref);
+	if(seeds_section.bytes != seeds.size()*sizeof(uint64) || memcmp(data, seeds.data(), seeds_section.bytes) != 0) {
+		printf("load_ref_bundle: Bundle %s was built with different hash functions, please rebuild it!\n", fname.c_str());
+		exit(1);
+	}
+
+	const uint64 n_kmer2 = ref.len - params->k2 + 1;
+	const uint64 n_windows = ref.len - params->ref_window_size + 1;
+	// (the window mask is only used at index time)
+	check_bundle_param(fname, "window mask size", find_bundle_section(fname, header, BUNDLE_WINDOW_MASK).bytes, (n_windows + 63)/64*sizeof(uint64));
+	const ref_bundle_section_t& offsets_section = find_bundle_section(fname, header, BUNDLE_FREQ_KMER_OFFSETS);
+	const ref_bundle_section_t& suffixes_section = find_bundle_section(fname, header, BUNDLE_FREQ_KMER_SUFFIXES);
+	check_bundle_param(fname, "frequent kmer offsets size", offsets_section.bytes, ((1ULL << FREQ_KMER_PREFIX_BITS) + 1)*sizeof(uint32));
+	const uint32* prefix_offsets = (const uint32*) map_bundle_section(fname, offsets_section, true, true, ref);
+	const uint16_t* suffixes = (const uint16_t*) map_bundle_section(fname, suffixes_section, true, true, ref);
+	ref.high_freq_kmers.set_views(prefix_offsets, offsets_section.bytes/sizeof(uint32), suffixes, suffixes_section.bytes/sizeof(uint16_t));
+
+	const ref_bundle_section_t& hashes_section = find_bundle_section(fname, header, BUNDLE_KMER2_HASHES);
+	check_bundle_param(fname, "kmer2 hashes size", hashes_section.bytes, n_kmer2*sizeof(kmer_cipher_t));
+	if(params->kmer2_mode == KMER2_LOAD || params->kmer2_mode == KMER2_MAP) {
+		const bool load = params->kmer2_mode == KMER2_LOAD;
+		ref.kmer2_ciphers.release();
+		ref.kmer2_ciphers.all_hashes = (const kmer_cipher_t*) map_bundle_section(fname, hashes_section, load, load, ref);
+		if(!load) {
+			madvise(ref.bundle.mappings.back().first, ref.bundle.mappings.back().second, MADV_RANDOM); // (scattered contig lookups)
+		}
+	}
+	const ref_bundle_section_t& repeats_section = find_bundle_section(fname, header, BUNDLE_KMER2_REPEATS);
+	check_bundle_param(fname, "kmer2 repeats size", repeats_section.bytes, n_kmer2*sizeof(uint16_t));
+	ref.bundle.neighbor_repeats = (const uint16_t*) map_bundle_section(fname, repeats_section, true, true, ref);
+
+	const ref_bundle_section_t& index_section = find_bundle_section(fname, header, BUNDLE_INDEX);
+	ref.bundle.index_offset = index_section.file_offset;
+	ref.bundle.index_bytes = index_section.bytes;
+	ref.bundle.loaded = true;
+	if(params->load_mhi) {
+		map_bundle_index(fname, ref, params);
+	}
+	return true;
+}
+
+// bucket exponent recorded in the bundle
+// returns 0 if the bundle does not exist
+uint32 load_ref_bundle_buckets_pow2(const char* refFname) {
+	std::string fname = get_ref_bundle_fname(refFname);
+	std::ifstream file;
+	file.open(fname.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return 0;
+	}
+	ref_bundle_header_t header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(!file || memcmp(header.magic, REF_BUNDLE_MAGIC, sizeof(header.magic)) != 0 || header.version != REF_BUNDLE_VERSION) {
+		printf("load_ref_bundle_buckets_pow2: Unsupported bundle file %s, please rebuild it!\n", fname.c_str());
+		exit(1);
+	}
+	file.close();
+	return header.n_buckets_pow2;
+}
+
+void kmer2_ciphers_t::release() {
+	if(mapped_addr != NULL) {
+		munmap(mapped_addr, mapped_len);
+		mapped_addr = NULL;
+		mapped_len = 0;
+	}
+	all_hashes = NULL;
+	std::vector<seq_t>().swap(range_starts);
+	std::vector<seq_t>().swap(range_ends);
+	std::vector<uint64>().swap(range_offsets);
+	std::vector<kmer_cipher_t>().swap(range_ciphers);
+}
+
+void static_index_t::release() {
+	if(mapped_addr != NULL) {
+		munmap(mapped_addr, mapped_len);
+		mapped_addr = NULL;
+		mapped_len = 0;
+	}
+	std::vector<loc_t>().swap(buckets_data);
+	std::vector<uint64>().swap(bucket_offsets);
+	std::vector<uint64>().swap(dir_bases_data);
+	std::vector<uint16_t>().swap(dir_rel16_data);
+	std::vector<uint32>().swap(dir_rel32_data);
+	std::vector<uint64>().swap(packed_data);
+	encoding = ENTRY_RAW;
+	dir_rel_bits = 32;
+	set_views();
+}
+
+// compacts the bucket offsets into the two-level bucket directory
+// (16-bit relative offsets if the entries of every block fit, 32-bit otherwise)
+// blocks never span tables: n_buckets_pow2 is the log2 of the buckets per table
+void static_index_t::build_bucket_directory(const uint32 n_buckets_pow2) {
+	const uint64 n = bucket_offsets.size();
+	dir_block_bits = std::min((uint32) BUCKET_DIR_BLOCK_BITS, n_buckets_pow2);
+	const uint64 block_size = 1ULL << dir_block_bits;
+	uint64 max_rel = 0;
+	for(uint64 b = 0; b < n; b += block_size) {
+		const uint64 last = std::min(n, b + block_size) - 1;
+		max_rel = std::max(max_rel, (bucket_offsets[last] & ~BUCKET_SKIP_FLAG) - (bucket_offsets[b] & ~BUCKET_SKIP_FLAG));
+	}
+	dir_rel_bits = (max_rel <= INT16_MAX) ? 16 : 32;
+	dir_bases_data.resize(((n - 1) >> dir_block_bits) + 1);
+	if(dir_rel_bits == 16) {
+		dir_rel16_data.resize(n);
+		std::vector<uint32>().swap(dir_rel32_data);
+		compact_bucket_offsets(bucket_offsets.data(), n, dir_block_bits, 16, dir_bases_data.data(), dir_rel16_data.data());
+	} else {
+		dir_rel32_data.resize(n);
+		std::vector<uint16_t>().swap(dir_rel16_data);
+		compact_bucket_offsets(bucket_offsets.data(), n, dir_block_bits, 32, dir_bases_data.data(), dir_rel32_data.data());
+	}
+	std::vector<uint64>().swap(bucket_offsets);
 }
 
 // store the reference index
 void store_ref_idx(const char* refFname, const ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
-	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-    fname += std::to_string(params->n_buckets_pow2);
-    fname += std::string("_k");
-    fname += std::to_string(params->k);
-    fname += std::string("_H");
-    fname += std::to_string(params->max_count);
+	std::string fname = get_ref_idx_fname(refFname, "idx", params);
 
 	std::ofstream file;
 	file.open(fname.c_str(), std::ios::out | std::ios::binary);
@@ -373,18 +1517,15 @@ void store_ref_idx(const char* refFname, const ref_t& ref, const index_params_t*
 		exit(1);
 	}
 
-	uint64 total_num_entries = 0;
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		total_num_entries += ref.mutable_index.per_table_buckets[i].n_entries;
-	}
+	uint64 total_num_entries = ref.index.n_entries;
 	file.write(reinterpret_cast<char*>(&total_num_entries), sizeof(total_num_entries));
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		const buckets_t& buckets = ref.mutable_index.per_table_buckets[i];
-		for(uint32 j = 0; j < params->n_buckets; j++) {
-			const VectorSeqPos& bucket = buckets.buckets_data_vectors[j];
-			uint32 size = bucket.size();
-			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
-			file.write(reinterpret_cast<const char*>(&bucket[0]), size*sizeof(loc_t));
+	for(uint64 bid = 0; bid < (uint64) params->n_tables*params->n_buckets; bid++) {
+		uint32 size = ref.index.bucket_size(bid);
+		file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		for(uint32 i = 0; i < size; i++) {
+			loc_t l;
+			ref.index.get_entry(bid, ref.index.bucket_start(bid) + i, l);
+			file.write(reinterpret_cast<const char*>(&l), sizeof(loc_t));
 		}
 	}
 	file.close();
@@ -392,22 +1533,7 @@ void store_ref_idx(const char* refFname, const ref_t& ref, const index_params_t*
 
 // load the reference index buckets
 void load_ref_idx(const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
-	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-	fname += std::to_string(params->n_buckets_pow2);
-	fname += std::string("_k");
-	fname += std::to_string(params->k);
-	fname += std::string("_H");
-	fname += std::to_string(params->max_count);
+	std::string fname = get_ref_idx_fname(refFname, "idx", params);
 
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
@@ -430,85 +1556,88 @@ void load_ref_idx(const char* refFname, ref_t& ref, const index_params_t* params
 			uint32 size;
 			file.read(reinterpret_cast<char*>(&size), sizeof(size));
 			file.read(reinterpret_cast<char*>(&ref.index.buckets_data[bucket_idx]), size*sizeof(loc_t));
-			std::sort(ref.index.buckets_data.begin() + bucket_idx, ref.index.buckets_data.begin() + bucket_idx + size, comp_loc());
 			bucket_idx += size;
+			if(params->hot_bucket(size)) { // hot bucket (the cap is not stored in this format)
+				ref.index.bucket_offsets[i*params->n_buckets + j] |= BUCKET_SKIP_FLAG;
+			}
 		}
 	}
 	ref.index.bucket_offsets[ref.index.bucket_offsets.size()-1] = bucket_idx;
 	file.close();
+	sort_index_buckets(ref.index, params);
+	ref.index.build_bucket_directory(params->n_buckets_pow2);
+	ref.index.set_views();
 }
 
-void store_ref_idx_per_thread(const int tid, const bool first_entry, const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx_tid");
-	fname += std::to_string(tid);
-
+// store a sorted run of the external-memory index builder:
+// the entry count of each table followed by the entries of each table (sorted by hash, pos)
+void store_ref_idx_run(const std::string& fname, const std::vector<VectorSeqPos>& table_entries, std::vector<uint64>& table_counts) {
 	std::ofstream file;
-	if(first_entry) {
-		file.open(fname.c_str(), std::ios::out | std::ios::binary);
-	} else {
-		file.open(fname.c_str(), std::ios::out | std::ios::binary | std::ios::app);
-	}
+	file.open(fname.c_str(), std::ios::out | std::ios::binary);
 	if (!file.is_open()) {
-		printf("store_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
+		printf("store_ref_idx_run: Cannot open the IDX run file %s!\n", fname.c_str());
 		exit(1);
 	}
-
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		buckets_t& buckets = ref.mutable_index.per_table_buckets[i];
-		for(uint32 j = 0; j < params->n_buckets; j++) {
-			VectorSeqPos& bucket = buckets.per_thread_buckets_data_vectors[tid][j];
-			uint32 size = buckets.per_thread_bucket_sizes[tid][j];
-			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
-			for(uint32 k = 0; k < size; k++) {
-				file.write(reinterpret_cast<const char*>(&bucket[k].pos), sizeof(seq_t));
-				file.write(reinterpret_cast<const char*>(&bucket[k].len), sizeof(len_t));
-				file.write(reinterpret_cast<const char*>(&bucket[k].hash), sizeof(minhash_t));
-			}
-			bucket.resize(0);
-			bucket.shrink_to_fit();
-		}
-		std::fill(buckets.per_thread_bucket_sizes[tid].begin(), buckets.per_thread_bucket_sizes[tid].end(), 0);
+	table_counts.resize(table_entries.size());
+	for(uint32 t = 0; t < table_entries.size(); t++) {
+		table_counts[t] = table_entries[t].size();
+	}
+	file.write(reinterpret_cast<const char*>(table_counts.data()), table_counts.size()*sizeof(uint64));
+	for(uint32 t = 0; t < table_entries.size(); t++) {
+		file.write(reinterpret_cast<const char*>(table_entries[t].data()), table_entries[t].size()*sizeof(loc_t));
+	}
+	if(!file) {
+		printf("store_ref_idx_run: Error writing the IDX run file %s!\n", fname.c_str());
+		exit(1);
 	}
 	file.close();
 }
 
-void load_ref_idx_per_thread(const int tid, const int nloads, const char* refFname, ref_t& ref, index_params_t* params) {
-	if(nloads == 0) return;
-
-	std::string fname(refFname);
-	fname += std::string(".idx_tid");
-	fname += std::to_string(tid);
-
-	std::ifstream file;
-	file.open(fname.c_str(), std::ios::in | std::ios::binary);
-	if (!file.is_open()) {
-		printf("load_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
-		std::cerr << "Error: " << strerror(errno) << "\n";
-		exit(1);
-	}
+void idx_run_reader_t::init(const int run_fd, const uint64 offset, const uint64 count, const uint32 buf_entries) {
+	fd = run_fd;
+	file_offset = offset;
+	remaining = count;
+	buf.resize(std::min((uint64) buf_entries, count));
+	buf_pos = 0;
+	buf_len = 0;
+}
 
-	for(int l = 0; l < nloads; l++) {
-		for(uint32 i = 0; i < params->n_tables; i++) {
-			buckets_t* buckets = &ref.mutable_index.per_table_buckets[i];
-			for(uint32 b = 0; b < params->n_buckets; b++) {
-				VectorSeqPos& global_bucket = buckets->buckets_data_vectors[b];
-				uint32 size;
-				file.read(reinterpret_cast<char*>(&size), sizeof(size));
-				for(uint32 k = 0; k < size; k++) {
-					loc_t w;
-					file.read(reinterpret_cast<char*>(&w.pos), sizeof(seq_t));
-					file.read(reinterpret_cast<char*>(&w.len), sizeof(len_t));
-					file.read(reinterpret_cast<char*>(&w.hash), sizeof(minhash_t));
-					global_bucket.push_back(w);
-				}
+bool idx_run_reader_t::next(loc_t& l) {
+	if(buf_pos == buf_len) {
+		if(remaining == 0) {
+			return false;
+		}
+		buf_len = std::min((uint64) buf.size(), remaining);
+		const size_t n_bytes = buf_len*sizeof(loc_t);
+		size_t n_read = 0;
+		while(n_read < n_bytes) {
+			const ssize_t r = pread(fd, (char*) buf.data() + n_read, n_bytes - n_read, file_offset + n_read);
+			if(r <= 0) {
+				printf("idx_run_reader_t: Error reading the IDX run file!\n");
+				exit(1);
 			}
+			n_read += r;
 		}
+		file_offset += n_bytes;
+		remaining -= buf_len;
+		buf_pos = 0;
 	}
-	file.close();
+	l = buf[buf_pos++];
+	return true;
 }
 
-/* Reads I/O */
+void write_file_at(const int fd, const void* data, const size_t n_bytes, const uint64 offset) {
+	size_t n_written = 0;
+	while(n_written < n_bytes) {
+		const ssize_t r = pwrite(fd, (const char*) data + n_written, n_bytes - n_written, offset + n_written);
+		if(r <= 0) {
+			printf("write_file_at: Error writing the IDX file!\n");
+			std::cerr << "Error: " << strerror(errno) << "\n";
+			exit(1);
+		}
+		n_written += r;
+	}
+}
 
 void fastq_error(const char* fastqFname) {
 	printf("Error: File %s does not comply with the FASTQ file format \n", fastqFname);
@@ -3,6 +3,7 @@
 
 #include <seqan/sequence.h>
 #include <seqan/seq_io.h>
+#include <functional>
 #include "types.h"
 #include "index.h"
 
@@ -126,7 +127,104 @@ struct precomp_contig_io_t {
 	}
 };
 
+// flat index file layout (all the sections are page aligned):
+// [header] [bucket directory block bases: n_offsets/2^dir_block_bits + 1 uint64]
+// [bucket directory relative offsets: n_tables*n_buckets + 1 uint16/uint32] [bucket entries: n_entries loc_t sorted by (hash, pos)]
+#define IDX_FLAT_MAGIC "BALAURIX"
+#define IDX_FLAT_VERSION 6
+#define IDX_FLAT_ALIGN 4096
+struct idx_flat_header_t {
+	char magic[8];
+	uint32 version;
+	uint32 loc_size;		// sizeof(loc_t) at build time
+	// index parameters
+	uint32 h;
+	uint32 n_tables;
+	uint32 sketch_proj_len;
+	uint32 ref_window_size;
+	uint32 ref_window_stride;
+	uint32 n_buckets_pow2;
+	uint32 k;
+	uint64 max_count;
+	uint64 ref_len;			// length of the indexed reference
+	// entry encoding (see static_index_t)
+	uint32 entry_encoding;
+	uint32 pos_bits;
+	uint32 len_bits;
+	uint32 entry_bits;
+	// bucket directory (see static_index_t)
+	uint32 dir_block_bits;
+	uint32 dir_rel_bits;
+	uint32 max_bucket_size;			// build-time cap of the buckets (larger buckets are marked as skipped)
+	// sections
+	uint64 n_entries;
+	uint64 n_offsets;
+	uint64 offsets_file_offset;		// directory block bases
+	uint64 dir_rel_file_offset;		// directory relative offsets
+	uint64 entries_file_offset;
+	uint64 entries_bytes;
+};
+
+// reference bundle: the precomputed reference data of one index configuration in a single file
+// [header: parameters, reference checksum, section table] [sections, each page aligned (IDX_FLAT_ALIGN)]
+// the index section is a flat index file image, each section can be mapped on its own and is used in place
+// the header and the sections except the index are checksummed
+#define REF_BUNDLE_MAGIC "BALAURBN"
+#define REF_BUNDLE_VERSION 1
+#define REF_BUNDLE_MAX_SECTIONS 16
+typedef enum {BUNDLE_HASH_FUNCTIONS = 1, BUNDLE_FREQ_KMER_OFFSETS, BUNDLE_FREQ_KMER_SUFFIXES, BUNDLE_WINDOW_MASK,
+	BUNDLE_KMER2_HASHES, BUNDLE_KMER2_REPEATS, BUNDLE_INDEX} ref_bundle_section_type;
+struct ref_bundle_section_t {
+	uint32 type;
+	uint32 unused;
+	uint64 file_offset;
+	uint64 bytes;
+	uint64 checksum;
+};
+struct ref_bundle_header_t {
+	char magic[8];
+	uint32 version;
+	uint32 n_sections;
+	// parameters
+	uint32 h;
+	uint32 n_tables;
+	uint32 sketch_proj_len;
+	uint32 ref_window_size;
+	uint32 ref_window_stride;
+	uint32 n_buckets_pow2;
+	uint32 k;
+	uint32 k2;
+	uint32 kmer_hashing_alg;
+	uint32 entry_encoding;
+	uint32 max_bucket_size;
+	uint32 max_matched_contig_len;
+	uint64 max_count;
+	// reference
+	uint64 ref_len;
+	uint64 ref_checksum;
+	ref_bundle_section_t sections[REF_BUNDLE_MAX_SECTIONS];
+	uint64 header_checksum;		// checksum of the preceding fields
+};
+
+typedef enum {PREFAULT_NONE = 0, PREFAULT_POPULATE = 1, PREFAULT_TOUCH = 2} idx_prefault_mode;
+typedef enum {KMER2_LOAD = 0, KMER2_MAP = 1, KMER2_ON_DEMAND = 2} kmer2_cipher_mode;
+
+// buffered reader over the entries of one table of a sorted run file (external-memory index builder)
+// the file descriptor can be shared across readers (pread)
+struct idx_run_reader_t {
+	int fd;
+	uint64 file_offset;
+	uint64 remaining;
+	std::vector<loc_t> buf;
+	uint32 buf_pos;
+	uint32 buf_len;
+
+	void init(const int run_fd, const uint64 offset, const uint64 count, const uint32 buf_entries);
+	bool next(loc_t& l);
+};
+
 void fasta2ref(const char *fastaFname, ref_t& ref);
+void append_fasta(const char* fastaFname, const char* extraFname, const char* outFname);
 void fastq2reads(const char *readsFname, reads_t& reads);
 void print_read(read_t* read);
 void parse_read_mapping(const char* read_name, unsigned int* seq_id, unsigned int* ref_pos_l, unsigned int* ref_pos_r, int* strand);
@@ -135,18 +233,37 @@ void store_valid_window_mask(const char* refFname, const ref_t& ref, const index
 bool load_valid_window_mask(const char* refFname, ref_t& ref, const index_params_t* params);
 
 // index io
+std::string get_window_mask_fname(const char* refFname, const index_params_t* params);
+std::string get_kmer2_hashes_fname(const char* refFname, const index_params_t* params);
+std::string get_repeat_info_fname(const char* refFname, const index_params_t* params);
+std::string get_ref_idx_fname(const char* refFname, const char* ext, const index_params_t* params);
 void store_ref_idx_flat(const char* refFname, const ref_t& ref, const index_params_t* params);
-void load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* params);  
+bool load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* params);
+uint32 load_ref_idx_flat_buckets_pow2(const char* refFname, const index_params_t* params);
+void store_ref_bundle(const char* refFname, const ref_t& ref, const index_params_t* params);
+bool load_ref_bundle(const char* refFname, ref_t& ref, const index_params_t* params);
+uint32 load_ref_bundle_buckets_pow2(const char* refFname);
 void store_ref_idx(const char* idxFname, const ref_t& ref, const index_params_t* params);
 void load_ref_idx(const char* idxFname, ref_t& ref, const index_params_t* params);
-void store_ref_idx_per_thread(const int tid, const bool first_entry, const char* refFname, ref_t& ref, const index_params_t* params);
-void load_ref_idx_per_thread(const int tid, const int nloads, const char* refFname, ref_t& ref, index_params_t* params);
+void init_ref_idx_flat_header(idx_flat_header_t& header, const uint64 n_entries, const uint32 dir_rel_bits, const seq_t ref_len, const index_params_t* params);
+void compact_bucket_offsets(const uint64* offsets, const uint64 n_buckets, const uint32 block_bits, const uint32 rel_bits,
+		uint64* bases, void* rel);
+void store_bucket_directory(const int fd, const idx_flat_header_t& header, const uint32 t, const std::vector<uint64>& table_offsets);
+void store_ref_idx_run(const std::string& fname, const std::vector<VectorSeqPos>& table_entries, std::vector<uint64>& table_counts);
+void write_file_at(const int fd, const void* data, const size_t n_bytes, const uint64 offset);
+void hash_kmer2_bases(const index_params_t* params, const char* bases, const seq_t n_kmers, kmer_cipher_t* hashes);
+void compute_kmer2_hashes(ref_t& ref, const index_params_t* params, const seq_t start_pos);
+void store_kmer2_hashes(const char* refFname, const ref_t& ref, const index_params_t* params);
 void compute_store_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params);
 bool load_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params);
+void compute_repeat_info(ref_t& ref, const index_params_t* params, const seq_t start_pos);
+void store_repeat_info(const char* refFname, const ref_t& ref, const index_params_t* params);
 void compute_store_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params);
 bool load_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params);
-void mark_windows_to_discard(ref_t& ref, const index_params_t* params);
-void mark_freq_kmers(ref_t& ref, const index_params_t* params);
+bool map_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params);
+void compute_contig_kmer2_ciphers(ref_t& ref, reads_t& reads, const index_params_t* params);
+void mark_windows_to_discard(ref_t& ref, const index_params_t* params, const seq_t start_pos);
+void mark_freq_kmers(ref_t& ref, const index_params_t* params, const seq_t start_pos);
 void compute_store_repeat_local(const char* refFname, ref_t& ref, const index_params_t* params);
 bool load_repeat_local(const char* refFname, ref_t& ref, const index_params_t* params);
 void load_precomp_contigs(const char* fileName, reads_t& reads);
@@ -157,7 +274,15 @@ void compute_and_store_kmer_hist32(const char* refFname, const char* seq, const
 void compute_and_store_kmer_hist16(const char* refFname, const char* seq, const seq_t seq_len, const index_params_t* params);
 void store_kmer_hist_stat(const char* refFname, const MapKmerCounts& hist);
 void load_freq_kmers(const char* refFname, std::set<uint64>& freq_kmers, const index_params_t* params);
-void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, MarisaTrie& freq_trie, const uint32 max_count_threshold);
+// unpacked block of the reference (see compute_store_kmer_hist): the bases [block_start, block_start + n_bases),
+// the blocks start at the multiples of REF_BLOCK_SIZE
+#define REF_BLOCK_SIZE (1 << 16)
+typedef std::function<void(const seq_t block_start, const char* bases, const seq_t n_bases)> ref_block_fn_t;
+void compute_store_kmer_hist(const char* refFname, const ref_t& ref, const index_params_t* params);
+void compute_store_kmer_hist(const char* refFname, const ref_t& ref, const index_params_t* params, const uint32 block_fn_len, const ref_block_fn_t& block_fn);
+bool load_kmer_hist_info(const char* refFname, uint32& threshold, uint32& k);
+bool kmer_hist_needs_count(const char* refFname, const index_params_t* params);
+void load_freq_kmers(const char* refFname, freq_kmer_set_t& freq_kmers, MarisaTrie& freq_trie, const uint32 max_count_threshold, const uint32 k);
 void kmer_stats(const char* refFname);
 void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_params_t* params);
 void ref_kmer_repeat_stats(const char* fastaFname, index_params_t* params, ref_t& ref);
@@ -1,5 +1,7 @@
 #include <emmintrin.h>
 #include <smmintrin.h>
+#include <immintrin.h>
+#include <cpuid.h>
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
@@ -46,6 +48,236 @@ void sha1_hash(const uint8_t *message, uint32_t len, uint32_t hash[5]) {
         sha1_compress(hash, block);
 }
 
+// --- batched kmer SHA-1 ---
+// all the kmers of a batch have the same length, so for k <= 55 each digest is a single
+// compression of the kmer followed by the same padding; the kmer ciphers are the first
+// 64 bits of the digest (hash[0] << 32 | hash[1])
+#define SHA1_MAX_SINGLE_BLOCK_LEN 55
+#define SHA1_AVX2_LANES 8
+
+static inline void sha1_pad_block(uint8_t block[64], const uint32 len) {
+	memset(block, 0, 64);
+	block[len] = 0x80;
+	const uint64_t bit_len = ((uint64_t) len) << 3;
+	for (uint32 i = 0; i < 8; i++)
+		block[64 - 1 - i] = (uint8_t)(bit_len >> (i * 8));
+}
+
+static void sha1_kmer_ciphers_scalar(const char* seq, const uint32 k, const uint64 n_kmers, uint64* ciphers) {
+	uint8_t block[64];
+	sha1_pad_block(block, k);
+	for (uint64 i = 0; i < n_kmers; i++) {
+		uint32_t hash[5] = {UINT32_C(0x67452301), UINT32_C(0xEFCDAB89), UINT32_C(0x98BADCFE), UINT32_C(0x10325476), UINT32_C(0xC3D2E1F0)};
+		memcpy(block, &seq[i], k);
+		sha1_compress(hash, block);
+		ciphers[i] = ((uint64) hash[0] << 32 | hash[1]);
+	}
+}
+
+// SHA-NI: SHA1_NI_LANES kmers are compressed in an interleaved fashion to hide the latency of sha1rnds4
+// the message is loaded straight from the sequence and merged with the padding of the block;
+// the kmers whose 16-byte loads would read past the sequence go through a local copy of the block
+// group g runs rounds [4g, 4g + 4); the message schedule of the next groups is expanded in place
+#define SHA1_NI_LANES 4
+__attribute__((target("sha,sse4.1")))
+static void sha1_kmer_ciphers_shani(const char* seq, const uint32 k, const uint64 n_kmers, uint64* ciphers) {
+	uint8_t block[64];
+	sha1_pad_block(block, k);
+	uint8_t keep[64];
+	for (uint32 j = 0; j < 64; j++) keep[j] = (j < k) ? 0xFF : 0;
+	const __m128i bswap_mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	const __m128i abcd_init = _mm_set_epi32(0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476);
+	const __m128i e_init = _mm_set_epi32(0xC3D2E1F0, 0, 0, 0);
+	const uint32 n_loads = (k + 15) / 16;
+	__m128i pad_words[4], keep_words[4];
+	for (int j = 0; j < 4; j++) {
+		pad_words[j] = _mm_loadu_si128((const __m128i*) &block[16*j]);
+		keep_words[j] = _mm_loadu_si128((const __m128i*) &keep[16*j]);
+	}
+	// kmers [0, n_direct) can be loaded in place
+	const uint64 n_direct = (n_kmers + k - 1 >= 16*n_loads) ? n_kmers + k - 16*n_loads : 0;
+
+	for (uint64 i = 0; i < n_kmers; i += SHA1_NI_LANES) {
+		__m128i msg[SHA1_NI_LANES][4];
+		for (int l = 0; l < SHA1_NI_LANES; l++) {
+			const uint64 pos = std::min(i + l, n_kmers - 1);
+			const char* src = &seq[pos];
+			if (pos >= n_direct) {
+				memcpy(block, src, k);
+				src = (const char*) block;
+			}
+			for (int j = 0; j < 4; j++) {
+				__m128i w = pad_words[j];
+				if (j < (int) n_loads) {
+					w = _mm_or_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*) &src[16*j]), keep_words[j]), _mm_andnot_si128(keep_words[j], w));
+				}
+				msg[l][j] = _mm_shuffle_epi8(w, bswap_mask);
+			}
+		}
+		__m128i abcd[SHA1_NI_LANES];
+		__m128i e[SHA1_NI_LANES][2];
+		for (int l = 0; l < SHA1_NI_LANES; l++) {
+			abcd[l] = abcd_init;
+			e[l][0] = _mm_add_epi32(e_init, msg[l][0]);
+			e[l][1] = abcd[l];
+			abcd[l] = _mm_sha1rnds4_epu32(abcd[l], e[l][0], 0);
+		}
+#define SHA1_NI_GROUP(g, f) \
+		for (int l = 0; l < SHA1_NI_LANES; l++) { \
+			const int cur = (g) & 1; \
+			e[l][cur] = _mm_sha1nexte_epu32(e[l][cur], msg[l][(g) & 3]); \
+			e[l][cur ^ 1] = abcd[l]; \
+			if ((g) >= 3 && (g) <= 18) msg[l][((g) + 1) & 3] = _mm_sha1msg2_epu32(msg[l][((g) + 1) & 3], msg[l][(g) & 3]); \
+			abcd[l] = _mm_sha1rnds4_epu32(abcd[l], e[l][cur], f); \
+			if ((g) >= 1 && (g) <= 16) msg[l][((g) - 1) & 3] = _mm_sha1msg1_epu32(msg[l][((g) - 1) & 3], msg[l][(g) & 3]); \
+			if ((g) >= 2 && (g) <= 17) msg[l][((g) - 2) & 3] = _mm_xor_si128(msg[l][((g) - 2) & 3], msg[l][(g) & 3]); \
+		}
+		SHA1_NI_GROUP(1, 0) SHA1_NI_GROUP(2, 0) SHA1_NI_GROUP(3, 0) SHA1_NI_GROUP(4, 0)
+		SHA1_NI_GROUP(5, 1) SHA1_NI_GROUP(6, 1) SHA1_NI_GROUP(7, 1) SHA1_NI_GROUP(8, 1) SHA1_NI_GROUP(9, 1)
+		SHA1_NI_GROUP(10, 2) SHA1_NI_GROUP(11, 2) SHA1_NI_GROUP(12, 2) SHA1_NI_GROUP(13, 2) SHA1_NI_GROUP(14, 2)
+		SHA1_NI_GROUP(15, 3) SHA1_NI_GROUP(16, 3) SHA1_NI_GROUP(17, 3) SHA1_NI_GROUP(18, 3) SHA1_NI_GROUP(19, 3)
+#undef SHA1_NI_GROUP
+		// only A and B are needed: the feed-forward of E is skipped
+		for (int l = 0; l < SHA1_NI_LANES && i + l < n_kmers; l++) {
+			const __m128i h = _mm_add_epi32(abcd[l], abcd_init);
+			ciphers[i + l] = ((uint64) (uint32) _mm_extract_epi32(h, 3) << 32) | (uint32) _mm_extract_epi32(h, 2);
+		}
+	}
+}
+
+// AVX2 multi-buffer: 8 consecutive kmers are hashed in the 32-bit lanes of one register
+// the message words are gathered straight from the sequence (kmer i + lane starts at seq[i + lane]),
+// so a batch may read up to 3 bytes past its last kmer; the caller finishes the tail
+#define SHA1_AVX2_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+__attribute__((target("avx2")))
+static uint64 sha1_kmer_ciphers_avx2(const char* seq, const uint32 k, const uint64 n_kmers, uint64* ciphers) {
+	const uint32 n_full_words = k / 4;
+	const uint32 n_tail_bytes = k % 4;
+	const __m256i bswap_mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m256i lane_offsets = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	// the word holding the last bytes of the kmer: keep its n_tail_bytes high bytes, then the 0x80 pad byte
+	const __m256i tail_keep = _mm256_set1_epi32(n_tail_bytes ? (int) (0xFFFFFFFFu << (32 - 8*n_tail_bytes)) : 0);
+	const __m256i tail_pad = _mm256_set1_epi32((int) (0x80000000u >> (8*n_tail_bytes)));
+	const __m256i k_const[4] = {_mm256_set1_epi32(0x5A827999), _mm256_set1_epi32(0x6ED9EBA1),
+			_mm256_set1_epi32((int) 0x8F1BBCDC), _mm256_set1_epi32((int) 0xCA62C1D6)};
+	const __m256i h0 = _mm256_set1_epi32(0x67452301);
+	const __m256i h1 = _mm256_set1_epi32((int) 0xEFCDAB89);
+
+	uint64 i = 0;
+	for (; i + SHA1_AVX2_LANES + 3 < n_kmers; i += SHA1_AVX2_LANES) {
+		const int* base = (const int*) &seq[i];
+		__m256i w[16];
+		for (uint32 j = 0; j < n_full_words; j++) {
+			w[j] = _mm256_shuffle_epi8(_mm256_i32gather_epi32(base + j, lane_offsets, 1), bswap_mask);
+		}
+		__m256i tail = tail_pad;
+		if (n_tail_bytes) {
+			tail = _mm256_shuffle_epi8(_mm256_i32gather_epi32(base + n_full_words, lane_offsets, 1), bswap_mask);
+			tail = _mm256_or_si256(_mm256_and_si256(tail, tail_keep), tail_pad);
+		}
+		w[n_full_words] = tail;
+		for (uint32 j = n_full_words + 1; j < 15; j++) {
+			w[j] = _mm256_setzero_si256();
+		}
+		w[15] = _mm256_set1_epi32(k << 3);
+
+		__m256i a = h0, b = h1, c = _mm256_set1_epi32((int) 0x98BADCFE), d = _mm256_set1_epi32(0x10325476), e = _mm256_set1_epi32((int) 0xC3D2E1F0);
+		for (uint32 r = 0; r < 80; r++) {
+			__m256i wr;
+			if (r < 16) {
+				wr = w[r];
+			} else {
+				wr = _mm256_xor_si256(_mm256_xor_si256(w[(r - 3) & 15], w[(r - 8) & 15]), _mm256_xor_si256(w[(r - 14) & 15], w[r & 15]));
+				wr = SHA1_AVX2_ROTL(wr, 1);
+				w[r & 15] = wr;
+			}
+			__m256i f;
+			if (r < 20) {
+				f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+			} else if (r < 40 || r >= 60) {
+				f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			} else {
+				f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+			}
+			const __m256i t = _mm256_add_epi32(_mm256_add_epi32(SHA1_AVX2_ROTL(a, 5), f),
+					_mm256_add_epi32(_mm256_add_epi32(e, k_const[r / 20]), wr));
+			e = d;
+			d = c;
+			c = SHA1_AVX2_ROTL(b, 30);
+			b = a;
+			a = t;
+		}
+		a = _mm256_add_epi32(a, h0);
+		b = _mm256_add_epi32(b, h1);
+		// interleave the lanes into (a << 32 | b)
+		const __m256i lo = _mm256_unpacklo_epi32(b, a);
+		const __m256i hi = _mm256_unpackhi_epi32(b, a);
+		_mm256_storeu_si256((__m256i*) &ciphers[i], _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*) &ciphers[i + 4], _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return i;
+}
+
+enum sha1_engine_t { SHA1_ENGINE_SCALAR, SHA1_ENGINE_AVX2, SHA1_ENGINE_SHANI };
+
+#define SHA1_CALIBRATION_KMERS 4096
+
+// times the engine on a synthetic sequence
+static double time_sha1_engine(const sha1_engine_t engine) {
+	std::vector<char> seq(SHA1_CALIBRATION_KMERS + 64);
+	for (uint32 i = 0; i < seq.size(); i++) seq[i] = (i * 7 + i / 5) & 3;
+	std::vector<uint64> ciphers(SHA1_CALIBRATION_KMERS);
+	const double start = omp_get_wtime();
+	if (engine == SHA1_ENGINE_SHANI) {
+		sha1_kmer_ciphers_shani(seq.data(), 20, SHA1_CALIBRATION_KMERS, ciphers.data());
+	} else {
+		sha1_kmer_ciphers_avx2(seq.data(), 20, SHA1_CALIBRATION_KMERS, ciphers.data());
+	}
+	return omp_get_wtime() - start;
+}
+
+// SHA-NI is not faster than the 8-lane AVX2 engine on all microarchitectures,
+// so when both are supported the faster one on a small sample is used
+static sha1_engine_t detect_sha1_engine() {
+	uint32 eax, ebx, ecx, edx;
+	const bool has_sha_ni = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && ((ebx >> 29) & 1);
+	const bool has_avx2 = __builtin_cpu_supports("avx2");
+	if (has_sha_ni && has_avx2) {
+		time_sha1_engine(SHA1_ENGINE_SHANI); // warm up
+		return (time_sha1_engine(SHA1_ENGINE_SHANI) < time_sha1_engine(SHA1_ENGINE_AVX2)) ? SHA1_ENGINE_SHANI : SHA1_ENGINE_AVX2;
+	}
+	if (has_sha_ni) return SHA1_ENGINE_SHANI;
+	if (has_avx2) return SHA1_ENGINE_AVX2;
+	return SHA1_ENGINE_SCALAR;
+}
+
+// computes the SHA-1 kmer ciphers of the n_kmers kmers of length k starting at seq[0..n_kmers)
+// dispatches at runtime to the fastest engine supported by the CPU (SHA-NI, AVX2 multi-buffer or scalar)
+void sha1_kmer_ciphers(const char* seq, const uint32 k, const uint64 n_kmers, uint64* ciphers) {
+	if (k > SHA1_MAX_SINGLE_BLOCK_LEN) {
+		uint32_t hash[5];
+		for (uint64 i = 0; i < n_kmers; i++) {
+			sha1_hash(reinterpret_cast<const uint8_t*>(&seq[i]), k, hash);
+			ciphers[i] = ((uint64) hash[0] << 32 | hash[1]);
+		}
+		return;
+	}
+	static const sha1_engine_t engine = detect_sha1_engine();
+	uint64 n_done = 0;
+	switch (engine) {
+		case SHA1_ENGINE_SHANI:
+			sha1_kmer_ciphers_shani(seq, k, n_kmers, ciphers);
+			return;
+		case SHA1_ENGINE_AVX2:
+			n_done = sha1_kmer_ciphers_avx2(seq, k, n_kmers, ciphers);
+			break;
+		case SHA1_ENGINE_SCALAR:
+			break;
+	}
+	sha1_kmer_ciphers_scalar(&seq[n_done], k, n_kmers - n_done, &ciphers[n_done]);
+}
+
 // returns the hamming distance between two 64-bit fingerprints
 int hamming_dist(hash_t h1, hash_t h2) {
 	return __builtin_popcountll(h1 ^ h2);
@@ -80,7 +312,7 @@ uint32_t get_kmer_weight(const char* kmer_seq, uint32 kmer_len,
 
 
 
-bool minhash(const std::string& seq, const VectorBool& ref_freq_kmer_bitmap, VectorMinHash& min_hashes) {
+bool minhash(const std::string& seq, const freq_kmer_set_t& ref_freq_kmers, VectorMinHash& min_hashes) {
 		const int n_kmers = get_n_kmers(seq.size(), params->k);
 		minhash_t v[n_kmers]  __attribute__((aligned(16)));;
 		uint32 n_valid_kmers = 0;
@@ -90,10 +322,10 @@ bool minhash(const std::string& seq, const VectorBool& ref_freq_kmer_bitmap, Vec
                 kmer_t<uint32> kmer;
 		while(seq_parser.get_next_kmer(kmer)) {
 			if(!kmer.valid) continue;
-			if(ref_freq_kmer_bitmap[kmer.packed]) continue;
+			if(ref_freq_kmers.contains(kmer.packed)) continue;
 
 			int i = seq_parser.pos - params->k;
-			v[n_valid_kmers] = CityHash32(&seq[i], params->k); 
+			v[n_valid_kmers] = kmer_hash32(&seq[i], params->k);
 			n_valid_kmers++;
         	}
 
@@ -130,6 +362,72 @@ bool minhash(const std::string& seq, const VectorBool& ref_freq_kmer_bitmap, Vec
         return true;
 }
 
+// computes the min-hash signature and, for each hash function, the next smallest kmer hash value
+// (the value the minimum takes if the minimizing kmer of the read is not in the reference window;
+// used for multi-probe queries)
+bool minhash_next(const std::string& seq, const freq_kmer_set_t& ref_freq_kmers, VectorMinHash& min_hashes,
+		VectorMinHash& next_min_hashes) {
+	const int n_kmers = get_n_kmers(seq.size(), params->k);
+	minhash_t v[n_kmers] __attribute__((aligned(16)));
+	uint32 n_valid_kmers = 0;
+
+	kmer_parser_t<uint32, 32> seq_parser;
+	seq_parser.init(seq, params->k);
+	kmer_t<uint32> kmer;
+	while(seq_parser.get_next_kmer(kmer)) {
+		if(!kmer.valid) continue;
+		if(ref_freq_kmers.contains(kmer.packed)) continue;
+
+		int i = seq_parser.pos - params->k;
+		v[n_valid_kmers] = kmer_hash32(&seq[i], params->k);
+		n_valid_kmers++;
+	}
+	if(n_valid_kmers <= 2*params->k) {
+		return false;
+	}
+
+	// each lane keeps its two smallest values: next = min(next, max(min, p)), min = min(min, p)
+	__m128i* vs = (__m128i*)v;
+	for(uint32_t h = 0; h < params->h; h++) {
+		const minhash_t s = params->minhash_functions[h].a;
+		const __m128i scalar = _mm_set1_epi32(s);
+		__m128i min_vec = _mm_set1_epi32(UINT_MAX);
+		__m128i next_vec = _mm_set1_epi32(UINT_MAX);
+		for(uint32 i = 0; i < n_valid_kmers/4; i++) {
+			const __m128i p = _mm_mullo_epi32(vs[i], scalar);
+			next_vec = _mm_min_epu32(next_vec, _mm_max_epu32(min_vec, p));
+			min_vec = _mm_min_epu32(min_vec, p);
+		}
+		minhash_t mins[4] __attribute__((aligned(16)));
+		minhash_t nexts[4] __attribute__((aligned(16)));
+		_mm_store_si128((__m128i*)mins, min_vec);
+		_mm_store_si128((__m128i*)nexts, next_vec);
+		minhash_t min = UINT_MAX;
+		minhash_t next = UINT_MAX;
+		for(int i = 0; i < 8; i++) {
+			const minhash_t p = (i < 4) ? mins[i] : nexts[i - 4];
+			if(p < min) {
+				next = min;
+				min = p;
+			} else if(p < next) {
+				next = p;
+			}
+		}
+		for(int i = 4*(n_valid_kmers/4); i < (int) n_valid_kmers; i++) {
+			const minhash_t p = s*v[i];
+			if(p < min) {
+				next = min;
+				min = p;
+			} else if(p < next) {
+				next = p;
+			}
+		}
+		min_hashes[h] = min;
+		next_min_hashes[h] = next;
+	}
+	return true;
+}
+
 void minhash_set(std::vector<minhash_t> encrypted_kmers, const index_params_t* params, VectorMinHash& min_hashes) {
 	for(uint32 i = 0; i < encrypted_kmers.size(); i++) {
 		minhash_t kmer_hash = encrypted_kmers[i];
@@ -145,89 +443,119 @@ void minhash_set(std::vector<minhash_t> encrypted_kmers, const index_params_t* p
 
 // avoid redundant computations
 // reference-only
-bool minhash_rolling_init(const char* seq, const seq_t ref_offset, const seq_t seq_len,
-					minhash_matrix_t& rolling_minhash_matrix,
-					const VectorBool& ref_freq_kmer_bitmask,
-					const index_params_t* params,
-					VectorMinHash& min_hashes) {
-
-	// initialize the rolling matrix
-	rolling_minhash_matrix.h_minhash_cols.resize(seq_len - params->k + 1);
-	for(uint32 pos = 0; pos < seq_len - params->k + 1; pos++) {
-		rolling_minhash_matrix.h_minhash_cols[pos].resize(params->h);
-	}
-	rolling_minhash_matrix.oldest_col_index = 0;
-
-	bool any_valid_kmers = false;
-	for(uint32 i = 0; i < seq_len - params->k + 1; i++) {
-		if(!ref_freq_kmer_bitmask[ref_offset + i]) { // check if the kmer should be discarded
-			minhash_t kmer_hash = CityHash32(&seq[ref_offset + i], params->k);
-			for(uint32_t h = 0; h < params->h; h++) { // update the min values
-				const rand_hash_function_t* f = &params->minhash_functions[h];
-				minhash_t min = f->apply(kmer_hash);
-				rolling_minhash_matrix.h_minhash_cols[i][h] = min;
-				if(min < min_hashes[h] || !any_valid_kmers) {
-					min_hashes[h] = min;
-				}
-			}
-			any_valid_kmers = true;
-		} else {
-			for(uint32_t h = 0; h < params->h; h++) {
-				rolling_minhash_matrix.h_minhash_cols[i][h] = UINT_MAX;
-			}
+void kmer_hash_stream_t::compute(const packed_seq_t& seq, const VectorBool& ref_freq_kmer_bitmask, const seq_t start, const seq_t end,
+		const index_params_t* params) {
+	this->start = start;
+	this->end = end;
+	hashes.resize(end - start);
+	const seq_t n_bases = std::min((uint64) end + params->k - 1, seq.size()) - start;
+	bases.resize(n_bases);
+	seq.unpack(start, n_bases, &bases[0]);
+	for(seq_t pos = start; pos < end; pos++) {
+		if(ref_freq_kmer_bitmask[pos]) { // kmer should be discarded
+			hashes[pos - start] = KMER_HASH_MASKED;
+			continue;
 		}
+		hashes[pos - start] = kmer_hash32(&bases[pos - start], params->k);
 	}
+}
 
-	if(!any_valid_kmers) {
-		std::fill(min_hashes.begin(), min_hashes.end(), UINT_MAX);
+void minhash_rolling_t::init(const seq_t window_len, const index_params_t* params) {
+	n = window_len - params->k + 1;
+	h = params->h;
+	a.resize(h);
+	for(uint32 i = 0; i < h; i++) {
+		a[i] = params->minhash_functions[i].a;
 	}
+	valid.resize(n);
+	block_vals.resize(n*h);
+	prev_suffix.resize(n*h);
+	prefix.resize(h);
+	reset(0);
+}
 
-	return any_valid_kmers;
+// start a new run of blocks at the given window (previous state is discarded)
+void minhash_rolling_t::reset(const seq_t window_pos) {
+	origin = window_pos;
+	next_kmer = window_pos;
+	n_valid_kmers = 0;
+	std::fill(prefix.begin(), prefix.end(), UINT_MAX);
+	std::fill(prev_suffix.begin(), prev_suffix.end(), UINT_MAX);
 }
 
-bool minhash_rolling(const char* seq, const seq_t ref_offset, const seq_t seq_len,
-					minhash_matrix_t& rolling_minhash_matrix,
-					const VectorBool& ref_freq_kmer_bitmask,
-					const index_params_t* params,
-					VectorMinHash& min_hashes) {
-
-	minhash_t new_kmer_hash = 0;
-	bool new_kmer_hash_valid = false;
-	seq_t last_kmer_pos = ref_offset + seq_len - params->k;
-	if(!ref_freq_kmer_bitmask[last_kmer_pos]) { // check if the kmer should be discarded
-		new_kmer_hash_valid = true;
-		new_kmer_hash = CityHash32(&seq[last_kmer_pos], params->k);
+void minhash_rolling_t::add_kmer(const kmer_hash_stream_t& kmer_hashes) {
+	const uint32 idx = (next_kmer - origin) % n;
+	minhash_t* vals = &block_vals[idx*h];
+	if(next_kmer - origin >= n && valid[idx]) {
+		n_valid_kmers--; // kmer leaving the window
 	}
-	bool any_valid_kmers = false;
-	for(uint32 h = 0; h < params->h; h++) {
-		minhash_t min_h = UINT_MAX;
-		if(new_kmer_hash_valid) {
-			const rand_hash_function_t* f = &params->minhash_functions[h];
-			min_h = f->apply(new_kmer_hash);
+	const minhash_t kmer_hash = kmer_hashes.get(next_kmer);
+	valid[idx] = (kmer_hash != KMER_HASH_MASKED);
+	if(valid[idx]) {
+		n_valid_kmers++;
+		const __m128i x = _mm_set1_epi32(kmer_hash);
+		uint32 i = 0;
+		for(; i + 4 <= h; i += 4) {
+			const __m128i v = _mm_mullo_epi32(_mm_loadu_si128((const __m128i*) &a[i]), x);
+			const __m128i p = _mm_loadu_si128((const __m128i*) &prefix[i]);
+			_mm_storeu_si128((__m128i*) &vals[i], v);
+			_mm_storeu_si128((__m128i*) &prefix[i], _mm_min_epu32(p, v));
 		}
-		// if less than current min, update min, populate oldest column
-		if(min_h < min_hashes[h]) {
-			min_hashes[h] = min_h;
-			rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] = min_h;
-		} else if(rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] != min_hashes[h]) {
-			// if the minimum doesn't come from the old column, no need to recompute
-			rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] = min_h;
-		} else {
-			// need to recompute the minimum
-			min_hashes[h] = UINT_MAX;
-			rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] = min_h;
-			for(uint32 i = 0; i < seq_len - params->k + 1; i++) {
-				if(rolling_minhash_matrix.h_minhash_cols[i][h] < min_hashes[h]) {
-					min_hashes[h] = rolling_minhash_matrix.h_minhash_cols[i][h];
-				}
-			}
+		for(; i < h; i++) {
+			vals[i] = a[i]*kmer_hash;
+			if(vals[i] < prefix[i]) prefix[i] = vals[i];
 		}
-		if(min_hashes[h] != UINT_MAX) {
-			any_valid_kmers = true;
+	} else {
+		std::fill(vals, vals + h, UINT_MAX);
+	}
+	next_kmer++;
+
+	if(idx == n - 1) { // block complete: compute its suffix minimums, start a new block
+		for(int j = (int) n - 2; j >= 0; j--) {
+			minhash_t* cur = &block_vals[j*h];
+			const minhash_t* next = &block_vals[(j+1)*h];
+			uint32 i = 0;
+			for(; i + 4 <= h; i += 4) {
+				const __m128i c = _mm_loadu_si128((const __m128i*) &cur[i]);
+				const __m128i nx = _mm_loadu_si128((const __m128i*) &next[i]);
+				_mm_storeu_si128((__m128i*) &cur[i], _mm_min_epu32(c, nx));
+			}
+			for(; i < h; i++) {
+				if(next[i] < cur[i]) cur[i] = next[i];
+			}
 		}
+		block_vals.swap(prev_suffix);
+		std::fill(prefix.begin(), prefix.end(), UINT_MAX);
+	}
+}
+
+// computes the min-hash signature of the window starting at window_pos
+// windows must be requested in increasing order; kmers of skipped windows are only added
+// if they overlap the requested window
+// returns false if the window contains no valid kmers
+bool minhash_rolling_t::window_minhash(const kmer_hash_stream_t& kmer_hashes, const seq_t window_pos, VectorMinHash& min_hashes) {
+	if(window_pos < origin || window_pos > next_kmer) { // no overlap with the current state
+		reset(window_pos);
+	}
+	while(next_kmer < window_pos + n) {
+		add_kmer(kmer_hashes);
+	}
+	if(n_valid_kmers == 0) {
+		std::fill(min_hashes.begin(), min_hashes.end(), UINT_MAX);
+		return false;
+	}
+	// window = suffix of the previous block + prefix of the current block
+	const minhash_t* suffix = &prev_suffix[((window_pos - origin) % n)*h];
+	uint32 i = 0;
+	for(; i + 4 <= h; i += 4) {
+		const __m128i s = _mm_loadu_si128((const __m128i*) &suffix[i]);
+		const __m128i p = _mm_loadu_si128((const __m128i*) &prefix[i]);
+		_mm_storeu_si128((__m128i*) &min_hashes[i], _mm_min_epu32(s, p));
+	}
+	for(; i < h; i++) {
+		min_hashes[i] = (suffix[i] < prefix[i]) ? suffix[i] : prefix[i];
 	}
-	rolling_minhash_matrix.oldest_col_index = (rolling_minhash_matrix.oldest_col_index + 1) % (seq_len - params->k + 1);
-	return any_valid_kmers;
+	return true;
 }
 
 /////////////////////////
@@ -11,26 +11,55 @@
 
 // LSH schemes
 
-// rolling min-hash structure
-struct minhash_matrix_t {
-	std::vector<VectorMinHash> h_minhash_cols;
-	uint32 oldest_col_index;
+// kmer hashes of a reference range (computed once per position)
+// discarded kmers are folded into the KMER_HASH_MASKED sentinel
+#define KMER_HASH_MASKED UINT_MAX
+
+// kmer hash of the reference and read signatures (never equal to the sentinel)
+static inline minhash_t kmer_hash32(const char* kmer, const uint32 k) {
+	const minhash_t kmer_hash = CityHash32(kmer, k);
+	return (kmer_hash == KMER_HASH_MASKED) ? (kmer_hash ^ 1) : kmer_hash;
+}
+struct kmer_hash_stream_t {
+	seq_t start;				// first kmer position
+	seq_t end;					// last kmer position + 1
+	VectorMinHash hashes;
+	std::string bases;			// unpacked reference range
+
+	void compute(const packed_seq_t& seq, const VectorBool& ref_freq_kmer_bitmask, const seq_t start, const seq_t end,
+			const index_params_t* params);
+	inline minhash_t get(const seq_t pos) const {
+		return hashes[pos - start];
+	}
 };
 
-void minhash_set(std::vector<minhash_t> encrypted_kmers, const index_params_t* params, VectorMinHash& min_hashes);
+// rolling min-hash over consecutive reference windows
+// sliding window minimum using block decomposition: kmers are grouped in blocks of n (= kmers per window),
+// a window spans the suffix of one block and the prefix of the next; per-kmer values are stored
+// as h-wide rows (SIMD across the hash functions), giving amortized O(h) work per window shift
+struct minhash_rolling_t {
+	uint32 n;					// number of kmers per window
+	uint32 h;					// number of hash functions
+	seq_t origin;				// first kmer position of the current run of blocks
+	seq_t next_kmer;			// next kmer position to be added
+	uint32 n_valid_kmers;		// number of valid kmers in the last n added
+	std::vector<char> valid;	// validity of the last n kmers added
+	VectorMinHash a;			// hash function multipliers
+	VectorMinHash block_vals;	// hash values of the kmers in the current block [n x h]
+	VectorMinHash prev_suffix;	// suffix minimums of the previous block [n x h]
+	VectorMinHash prefix;		// prefix minimum of the current block [h]
 
-bool minhash(const std::string& seq, const VectorBool& ref_freq_kmer_bitmap, VectorMinHash& min_hashes);
-bool minhash_rolling_init(const char* seq, const seq_t ref_offset, const seq_t seq_len,
-		minhash_matrix_t& rolling_minhash_matrix,
-		const VectorBool& ref_freq_kmer_bitmask,
-		const index_params_t* params,
-		VectorMinHash& min_hashes);
-bool minhash_rolling(const char* seq, const seq_t ref_offset, const seq_t seq_len,
-		minhash_matrix_t& rolling_minhash_matrix,
-		const VectorBool& ref_freq_kmer_bitmask,
-		const index_params_t* params,
-		VectorMinHash& min_hashes);
+	void init(const seq_t window_len, const index_params_t* params);
+	void reset(const seq_t window_pos);
+	void add_kmer(const kmer_hash_stream_t& kmer_hashes);
+	bool window_minhash(const kmer_hash_stream_t& kmer_hashes, const seq_t window_pos, VectorMinHash& min_hashes);
+};
+
+void minhash_set(std::vector<minhash_t> encrypted_kmers, const index_params_t* params, VectorMinHash& min_hashes);
 
+bool minhash(const std::string& seq, const freq_kmer_set_t& ref_freq_kmers, VectorMinHash& min_hashes);
+bool minhash_next(const std::string& seq, const freq_kmer_set_t& ref_freq_kmers, VectorMinHash& min_hashes,
+		VectorMinHash& next_min_hashes);
 hash_t simhash(const char* seq, const seq_t seq_offset, const seq_t seq_len,
 		const MapKmerCounts& ref_hist, const MapKmerCounts& reads_hist,
 		const index_params_t* params, const uint8_t is_ref);
@@ -39,6 +39,9 @@
 
 void print_usage() {
 	printf("Usage: ./balaur [options] <index|align> <ref.fa> <reads.fq> \n");
+	printf("       ./balaur [options] merge <ref.fa> <part1.fa> ... <partN.fa> \n");
+	printf("       ./balaur [options] prep <ref.fa> \n");
+	printf("       ./balaur [options] bundle <ref.fa> \n");
 	printf("Hashing options:\n\n");
 	printf("       -h        number of hash functions for MinHash fingerprint construction (i.e. fingerprint length) [%d]\n", params->h);
 	printf("       -T        number of hash tables [%d]\n", params->n_tables);
@@ -46,12 +49,22 @@ void print_usage() {
 	printf("       -b        length of the fingerprint projections [%d]\n", params->sketch_proj_len);
 	printf("\nIndex-only options:\n\n");
 	printf("       -w       length of the reference windows to hash (should be set to the expected read length for optimal results) [%d]\n", params->ref_window_size);
+	printf("       -p        log2 of the number of buckets per hash table (0: chosen from the number of valid windows and recorded in the index) [%d]\n", params->n_buckets_pow2);
+	printf("       --bucket-load <n>  target number of indexed windows per bucket with -p 0 [%d]\n", params->bucket_load);
+	printf("       --max-bucket-size <n>  drop the buckets with more entries and mark them to be skipped by the queries (0: keep all the buckets of less than 2^32 entries) [%d]\n", params->max_bucket_size);
+	printf("       --stride <s>  index only every s-th reference window (must also be given at alignment) [%d]\n", params->ref_window_stride);
 	printf("       -H       upper bound on kmer occurrence in the reference [%llu]\n", params->max_count);
+	printf("       -e        index entry encoding: 0 raw, 1 bit-packed [%d]\n", params->idx_entry_encoding);
+	printf("       --mem-budget <size>  build the index out of core within the given memory budget (e.g. 512M, 8G; default: in memory)\n");
+	printf("       --append <extra.fa>  add the sequences of extra.fa to an existing index (and to ref.fa) without re-indexing ref.fa\n");
 	printf("       -s        initially allocated hash table bucket size [%d]\n", params->bucket_size);
 	printf("\nAlignment-only options:\n\n");
 	printf("       -m       candidate contig filtering: min required number of index buckets shared with the read [%d]\n", params->min_n_hits);
 	printf("       -N       candidate contig filtering: max distance from the best found number of buckets shared with a contig [%d]\n", params->dist_best_hit);
+	printf("       --probes <n>  multi-probe queries: number of additional buckets searched per hash table (at most 2^b - 1) [%d]\n", params->n_probes);
 	printf("       -L        load precomputed candidate contigs [%d]\n", params->k2);
+	printf("       -P        index pre-fault mode: 0 none, 1 MAP_POPULATE, 2 parallel page touch [%d]\n", params->idx_prefault);
+	printf("       --kmer2-mode <n>  reference kmer2 ciphers: 0 load the precomputed hashes, 1 map the precomputed hashes, 2 compute the candidate contig ciphers on demand [%d]\n", params->kmer2_mode);
 	printf("       -z        precomputed candidate contigs file (store/load) [%d]\n", params->k2);
 	printf("       -v        length k2 of kmers counted during voting [%d]\n", params->k2);
 	printf("       -d        votes array convolution radius  [%d]\n", params->delta_inlier);
@@ -68,17 +81,46 @@ void print_usage() {
 	printf("       -t        number of threads [%d]\n", params->n_threads);
 }
 
+// parses a memory size with an optional K/M/G suffix (default: MB)
+uint64 parse_mem_size(const char* arg) {
+	char* end;
+	const double v = strtod(arg, &end);
+	switch(toupper(*end)) {
+		case 'K': return v*(1ULL << 10);
+		case 'G': return v*(1ULL << 30);
+		default: return v*(1ULL << 20);
+	}
+}
+
+#define OPT_MEM_BUDGET 256
+#define OPT_APPEND 257
+#define OPT_STRIDE 258
+#define OPT_PROBES 259
+#define OPT_BUCKET_LOAD 260
+#define OPT_MAX_BUCKET_SIZE 261
+#define OPT_KMER2_MODE 262
+static struct option long_options[] = {
+	{"mem-budget", required_argument, 0, OPT_MEM_BUDGET},
+	{"append", required_argument, 0, OPT_APPEND},
+	{"stride", required_argument, 0, OPT_STRIDE},
+	{"probes", required_argument, 0, OPT_PROBES},
+	{"bucket-load", required_argument, 0, OPT_BUCKET_LOAD},
+	{"max-bucket-size", required_argument, 0, OPT_MAX_BUCKET_SIZE},
+	{"kmer2-mode", required_argument, 0, OPT_KMER2_MODE},
+	{0, 0, 0, 0}
+};
+
 index_params_t* params;
 int main(int argc, char *argv[]) {
 	params = new index_params_t();
 	params->set_default_index_params();
 
-	if (argc < 4) {
+	if (argc < 3 || (strcmp(argv[1], "align") == 0 && argc < 4)) {
 		print_usage();
 		exit(1);
 	}
 	int c;
-	while ((c = getopt(argc-1, argv+1, "t:w:k:h:H:T:b:p:m:s:d:v:N:c:x:Lf:z:I:S:B:MV")) >= 0) {
+	while ((c = getopt_long(argc-1, argv+1, "t:w:k:h:H:T:b:p:m:s:d:v:N:c:x:Lf:z:I:S:B:P:e:MV", long_options, NULL)) >= 0) {
 		switch (c) {
 			case 't': params->n_threads = atoi(optarg); break;
 			case 'h': params->h = atoi(optarg); break;
@@ -88,10 +130,12 @@ int main(int argc, char *argv[]) {
 			case 'w': params->ref_window_size = atoi(optarg); break;
 			case 'p': params->n_buckets_pow2 = atoi(optarg); break;
 			case 's': params->bucket_size = atoi(optarg); break;
+			case 'e': params->idx_entry_encoding = atoi(optarg); break;
 			case 'H': params->max_count = atoi(optarg); break;
 			case 'm': params->min_n_hits = atoi(optarg); break;
 			case 'N': params->dist_best_hit = atoi(optarg); break;
 			case 'L': params->load_mhi = false; break;
+			case 'P': params->idx_prefault = atoi(optarg); break;
 			case 'z': params->precomp_contig_file_name = std::string(optarg); break;
 			case 'v': params->k2 = atoi(optarg); break;
 			case 'd': params->delta_inlier = atoi(optarg); break;
@@ -103,9 +147,46 @@ int main(int argc, char *argv[]) {
 			case 'S': params->batch_size = atoi(optarg); break;
 			case 'B': params->bin_size = atoi(optarg); break;
 			case 'M': params->mask_repeat_nbrs = true; break;
+			case OPT_MEM_BUDGET: params->mem_budget = parse_mem_size(optarg); break;
+			case OPT_APPEND: params->append_fasta_fname = std::string(optarg); break;
+			case OPT_STRIDE: params->ref_window_stride = atoi(optarg); break;
+			case OPT_PROBES: params->n_probes = atoi(optarg); break;
+			case OPT_BUCKET_LOAD: params->bucket_load = atoi(optarg); break;
+			case OPT_MAX_BUCKET_SIZE: params->max_bucket_size = atoi(optarg); break;
+			case OPT_KMER2_MODE: params->kmer2_mode = atoi(optarg); break;
 			default: return 0;
 		}
 	}
+	if(params->ref_window_stride < 1 || params->ref_window_stride >= MAX_LOC_LEN/2) {
+		printf("Invalid reference window stride %d!\n", params->ref_window_stride);
+		exit(1);
+	}
+	if(params->n_probes >= (1U << params->sketch_proj_len) || params->n_tables*(params->n_probes + 1) > UINT16_MAX) {
+		printf("Invalid number of probes per table %d (at most 2^b - 1)!\n", params->n_probes);
+		exit(1);
+	}
+	if(strcmp(argv[1], "index") == 0 && params->append_fasta_fname.empty() && params->mem_budget > 0 && params->idx_entry_encoding != ENTRY_RAW) {
+		printf("The external-memory index builder (--mem-budget) only stores raw index entries (-e 0)!\n");
+		exit(1);
+	}
+	if(params->kmer2_mode > KMER2_ON_DEMAND) {
+		printf("Invalid kmer2 cipher mode %d!\n", params->kmer2_mode);
+		exit(1);
+	}
+	if(params->idx_prefault > PREFAULT_TOUCH) {
+		printf("Invalid index pre-fault mode %d!\n", params->idx_prefault);
+		exit(1);
+	}
+	params->auto_n_buckets = (params->n_buckets_pow2 == 0);
+	if(params->n_buckets_pow2 > MAX_N_BUCKETS_POW2 || params->bucket_load < 1) {
+		printf("Invalid number of buckets per table 2^%d (at most 2^%d) or bucket load %d!\n", params->n_buckets_pow2,
+				MAX_N_BUCKETS_POW2, params->bucket_load);
+		exit(1);
+	}
+	if(((uint64) params->n_tables << std::max(params->n_buckets_pow2, (uint32) MIN_N_BUCKETS_POW2)) > UINT32_MAX) { // 32-bit bucket ids
+		printf("Too many buckets across the %d hash tables (-T %d, -p %d)!\n", params->n_tables, params->n_tables, params->n_buckets_pow2);
+		exit(1);
+	}
 	srand(1);
 	params->set_kmer_hash_function();
 	params->set_minhash_hash_function();
@@ -122,11 +203,30 @@ int main(int argc, char *argv[]) {
 	}
 		
 	printf("**********BALAUR**************\n");
-	params->n_buckets = pow(2, params->n_buckets_pow2);
+	if(!params->auto_n_buckets) {
+		params->set_n_buckets(params->n_buckets_pow2);
+	}
 	if (strcmp(argv[1], "index") == 0) {
 		ref_t ref;
-		index_ref_lsh(argv[optind+1], params, ref);
-		store_index_ref_lsh(argv[optind+1], params, ref);
+		if(!params->append_fasta_fname.empty()) {
+			append_index_ref_lsh(argv[optind+1], params->append_fasta_fname.c_str(), params, ref);
+		} else {
+			index_ref_lsh(argv[optind+1], params, ref);
+			store_index_ref_lsh(argv[optind+1], params, ref);
+		}
+	} else if (strcmp(argv[1], "merge") == 0) {
+		std::vector<std::string> part_fnames;
+		for(int i = optind+2; i < argc; i++) {
+			part_fnames.push_back(std::string(argv[i]));
+		}
+		merge_index_ref_lsh(argv[optind+1], part_fnames, params);
+	} else if (strcmp(argv[1], "prep") == 0) {
+		prep_ref(argv[optind+1], params);
+	} else if (strcmp(argv[1], "bundle") == 0) {
+		if(params->auto_n_buckets) { // use the bucket count of the flat index being bundled
+			load_index_n_buckets(argv[optind+1], params, false);
+		}
+		bundle_ref(argv[optind+1], params);
 	} else if (strcmp(argv[1], "align") == 0) {
 		ref_t ref;
 		//load_index_ref_lsh(argv[optind+1], params, ref);
@@ -138,6 +238,10 @@ int main(int argc, char *argv[]) {
 		fastq_reader_t reader;
 		reader.open_file(argv[optind+2]);
 		
+		if(params->load_mhi && params->auto_n_buckets) { // use the bucket count chosen at index time
+			load_index_n_buckets(argv[optind+1], params, true);
+		}
+
 		precomp_contig_io_t contig_io;
 		if(params->load_mhi) {
 			if(params->precomp_contig_file_name.size() != 0) {
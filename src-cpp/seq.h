@@ -5,6 +5,7 @@
 #include <istream>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include "types.h"
 
 // compression
@@ -24,6 +25,97 @@ int pack_64(const char *seq, const int length, uint64 *ret);
 void unpack_32(uint32 w, unsigned char *seq, const uint32 length);
 
 #define CHAR_MASK 3ULL
+
+// 2-bit packed sequence: 32 bases per word with the first base in the top bits (as pack_64)
+// the ambiguous bases (BASE_IGNORE) are stored as 0 and listed as sorted runs
+#define BASES_PER_LWORD 32
+struct packed_seq_t {
+	std::vector<uint64> words;	// (padded by one word for the kmer extraction)
+	std::vector<std::pair<seq_t, seq_t> > n_runs; // [start, end) runs of ambiguous bases
+	uint64 len;
+
+	packed_seq_t() : len(0) {}
+
+	uint64 size() const {
+		return len;
+	}
+	uint64 bytes() const {
+		return words.size()*sizeof(uint64) + n_runs.size()*sizeof(n_runs[0]);
+	}
+	// extends the sequence (the new bases are 0 until set)
+	void resize(const uint64 new_len) {
+		words.resize(new_len/BASES_PER_LWORD + 2, 0);
+		len = new_len;
+	}
+	// appends a run of ambiguous bases (runs must be added in position order)
+	void add_n_run(const seq_t start, const seq_t end) {
+		if(n_runs.size() > 0 && n_runs.back().second == start) {
+			n_runs.back().second = end;
+		} else {
+			n_runs.push_back(std::make_pair(start, end));
+		}
+	}
+
+	// kmer of length k <= 32 starting at pos, packed as pack_64 (ambiguous bases read as 0)
+	inline uint64 get_kmer(const seq_t pos, const uint32 k) const {
+		const uint64 w = pos / BASES_PER_LWORD;
+		const uint32 shift = (pos % BASES_PER_LWORD)*BITS_PER_CHAR;
+		uint64 v = words[w] << shift;
+		if(shift > 0) {
+			v |= words[w + 1] >> (BITS_IN_LWORD - shift);
+		}
+		return v & (~0ULL << (BITS_IN_LWORD - k*BITS_PER_CHAR));
+	}
+	// first ambiguous run ending after pos
+	inline std::vector<std::pair<seq_t, seq_t> >::const_iterator next_n_run(const seq_t pos) const {
+		return std::upper_bound(n_runs.begin(), n_runs.end(), std::make_pair(pos, pos),
+				[](const std::pair<seq_t, seq_t>& a, const std::pair<seq_t, seq_t>& b) { return a.second < b.second; });
+	}
+	// does [pos, pos + n) contain ambiguous bases
+	inline bool has_ambiguous(const seq_t pos, const seq_t n) const {
+		std::vector<std::pair<seq_t, seq_t> >::const_iterator it = next_n_run(pos);
+		return it != n_runs.end() && it->first < pos + n;
+	}
+	inline char get_base(const seq_t pos) const {
+		if(has_ambiguous(pos, 1)) return BASE_IGNORE;
+		return (words[pos / BASES_PER_LWORD] >> (BITS_IN_LWORD - (pos % BASES_PER_LWORD + 1)*BITS_PER_CHAR)) & CHAR_MASK;
+	}
+	// decodes the bases [pos, pos + n) (one base per char, ambiguous bases as BASE_IGNORE)
+	void unpack(const seq_t pos, const seq_t n, char* out) const {
+		for(seq_t i = 0; i < n; ) {
+			const uint64 w = words[(pos + i) / BASES_PER_LWORD];
+			const uint32 j = (pos + i) % BASES_PER_LWORD;
+			if(j == 0 && n - i >= BASES_PER_LWORD) { // whole word
+				for(uint32 t = 0; t < BASES_PER_LWORD; t++) {
+					out[i + t] = (w >> (BITS_IN_LWORD - (t + 1)*BITS_PER_CHAR)) & CHAR_MASK;
+				}
+				i += BASES_PER_LWORD;
+			} else {
+				out[i] = (w >> (BITS_IN_LWORD - (j + 1)*BITS_PER_CHAR)) & CHAR_MASK;
+				i++;
+			}
+		}
+		for(std::vector<std::pair<seq_t, seq_t> >::const_iterator it = next_n_run(pos); it != n_runs.end() && it->first < pos + n; it++) {
+			for(seq_t i = std::max(it->first, pos); i < std::min(it->second, pos + n); i++) {
+				out[i - pos] = BASE_IGNORE;
+			}
+		}
+	}
+	// do the bases [pos, pos + other.len) match the other sequence
+	bool matches(const seq_t pos, const packed_seq_t& other) const {
+		if(pos + other.len > len) return false;
+		for(seq_t i = 0; i < other.len; i += BASES_PER_LWORD) {
+			const uint32 k = std::min((uint64) BASES_PER_LWORD, other.len - i);
+			if(get_kmer(pos + i, k) != other.get_kmer(i, k)) return false;
+		}
+		std::vector<std::pair<seq_t, seq_t> >::const_iterator it = next_n_run(pos);
+		for(uint64 r = 0; r < other.n_runs.size(); r++, it++) {
+			if(it == n_runs.end() || std::max(it->first, pos) - pos != other.n_runs[r].first
+					|| std::min((uint64) it->second, pos + other.len) - pos != other.n_runs[r].second) return false;
+		}
+		return it == n_runs.end() || it->first >= pos + other.len;
+	}
+};
 //typedef uint32 packed_kmer_t;
 template<typename packed_kmer_t>
 struct kmer_t {
@@ -40,9 +40,59 @@ void load_freq_kmers(const char* refFname, std::set<uint64>& freq_kmers, const i
 	printf("Filtered %u kmers\n", filtered);
 }
 
-void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, MarisaTrie& freq_trie, const uint32 max_count_threshold) {
+// the -H threshold and kmer length recorded with the kmer histogram (the histogram only holds the kmers occurring
+// at least threshold times); returns false if they were not recorded (e.g. a histogram counted externally)
+bool load_kmer_hist_info(const char* refFname, uint32& threshold, uint32& k) {
+	std::string fname(refFname);
+	fname += std::string(".kmer_hist.H");
+	std::ifstream file;
+	file.open(fname.c_str(), std::ios::in);
+	if (!file.is_open()) {
+		return false;
+	}
+	threshold = 0;
+	k = 0;
+	file >> threshold >> k;
+	file.close();
+	return true;
+}
+
+// whether the kmer histogram must be (re)counted: it does not exist, or was recorded for a larger -H or a different -k
+// (a histogram without the recorded threshold is reused, see load_freq_kmers)
+bool kmer_hist_needs_count(const char* refFname, const index_params_t* params) {
 	std::string fname(refFname);
 	fname += std::string(".kmer_hist");
+	std::ifstream file;
+	file.open(fname.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return true;
+	}
+	file.close();
+	uint32 threshold, k;
+	if(!load_kmer_hist_info(refFname, threshold, k)) {
+		return false;
+	}
+	return threshold > params->max_count || k != params->k;
+}
+
+void load_freq_kmers(const char* refFname, freq_kmer_set_t& freq_kmers, MarisaTrie& freq_trie, const uint32 max_count_threshold, const uint32 k) {
+	std::string fname(refFname);
+	fname += std::string(".kmer_hist");
+	uint32 hist_threshold, hist_k;
+	static bool warned = false; // (the frequent kmers are loaded again for each read batch)
+	if(!load_kmer_hist_info(refFname, hist_threshold, hist_k)) {
+		if(!warned) printf("load_kmer_hist: WARNING: No -H/-k recorded for the hist file %s (%s.H), assuming it holds all the kmers of length %u occurring at least %u times\n",
+				fname.c_str(), fname.c_str(), k, max_count_threshold);
+		warned = true;
+	} else if(hist_k != k) {
+		printf("load_kmer_hist: The hist file %s was counted for kmers of length %u (-k %u), please recount it!\n",
+				fname.c_str(), hist_k, k);
+		exit(1);
+	} else if(hist_threshold > max_count_threshold) {
+		printf("load_kmer_hist: The hist file %s only holds the kmers occurring at least %u times (-H %u), please recount it!\n",
+				fname.c_str(), hist_threshold, max_count_threshold);
+		exit(1);
+	}
 
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
@@ -51,7 +101,7 @@ void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, Marisa
 		printf("load_kmer_hist: Cannot open the hist file %s!\n", fname.c_str());
 		exit(1);
 	}
-	freq_kmers_bitmap.resize(UINT_MAX + 1L);
+	std::vector<uint32> freq_kmers_list;
 	uint32 kmer, count;
 	uint32 filtered = 0;
 	uint32 tot_filtered = 0;
@@ -60,13 +110,17 @@ void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, Marisa
 #if(USE_MARISA)
 	marisa::Keyset keys;
 #endif
-	while(map_size >= 0) {
+	while(map_size > 0) {
 		file.read(reinterpret_cast<char*>(&kmer), sizeof(kmer));
 		file.read(reinterpret_cast<char*>(&count), sizeof(count));
+		if(!file) {
+			printf("load_kmer_hist: Truncated hist file %s!\n", fname.c_str());
+			exit(1);
+		}
 		if(count >= max_count_threshold) {
 			tot_filtered++;
 			//if (!kmer_has_zero(kmer)) {
-			freq_kmers_bitmap[kmer] = true;
+			freq_kmers_list.push_back(kmer);
 			filtered++;
 			//}
 #if(USE_MARISA)
@@ -83,7 +137,236 @@ void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, Marisa
 	freq_trie.build(keys, 0);
 #endif
 	file.close();
-	printf("Filtered %u kmers, tot %u \n", filtered, tot_filtered);
+	freq_kmers.build(freq_kmers_list);
+	printf("Filtered %u kmers, tot %u (%.2f MB filter)\n", filtered, tot_filtered, (double) freq_kmers.bytes()/(1024*1024));
+}
+
+// calls f(pos, kmer) for the kmers of the reference starting in [start, end) without ambiguous bases
+// (kmer: packed as pack_32)
+template<typename F>
+static void for_each_ref_kmer(const ref_t& ref, const uint32 k, const seq_t start, const seq_t end, F f) {
+	std::vector<std::pair<seq_t, seq_t> >::const_iterator run = ref.seq.next_n_run(start);
+	for(seq_t pos = start; pos < end; pos++) {
+		while(run != ref.seq.n_runs.end() && run->second <= pos) run++;
+		if(run != ref.seq.n_runs.end() && run->first < pos + k) { // skip the kmers overlapping the run
+			pos = run->second - 1;
+			continue;
+		}
+		f(pos, (uint32) (ref.seq.get_kmer(pos, k) >> BITS_IN_WORD));
+	}
+}
+
+// counts the kmers of the reference and stores the kmers occurring at least params->max_count times
+// in the .kmer_hist format of load_freq_kmers (map size, then sorted kmer/count pairs)
+// and the threshold and kmer length in .kmer_hist.H
+// the kmers are partitioned by their top KMER_HIST_PREFIX_BITS bits: each thread scans a slice of the reference
+// and scatters the kmer suffixes of a range of prefixes into per (prefix, slice) offsets, then the prefix groups
+// are sorted and counted independently; with a memory budget (--mem-budget) the prefixes are split into
+// several ranges, each scanning the reference again
+// the slices are runs of whole REF_BLOCK_SIZE blocks: the first scan unpacks each block once and also
+// hands it to block_fn (bases for the positions of the block and the block_fn_len - 1 next bases)
+#define KMER_HIST_PREFIX_BITS 16
+
+// LSD radix sort of v[0, n) by byte (tmp: scratch space)
+static void sort_u16(uint16_t* v, const uint64 n, std::vector<uint16_t>& tmp) {
+	if(n < 64) {
+		std::sort(v, v + n);
+		return;
+	}
+	tmp.resize(n);
+	uint64 lo_counts[256] = { 0 };
+	uint64 hi_counts[256] = { 0 };
+	for(uint64 i = 0; i < n; i++) {
+		lo_counts[v[i] & 0xFF]++;
+		hi_counts[v[i] >> 8]++;
+	}
+	uint64 lo_offset = 0;
+	uint64 hi_offset = 0;
+	for(uint32 b = 0; b < 256; b++) {
+		const uint64 lo = lo_counts[b];
+		const uint64 hi = hi_counts[b];
+		lo_counts[b] = lo_offset;
+		hi_counts[b] = hi_offset;
+		lo_offset += lo;
+		hi_offset += hi;
+	}
+	for(uint64 i = 0; i < n; i++) {
+		tmp[lo_counts[v[i] & 0xFF]++] = v[i];
+	}
+	for(uint64 i = 0; i < n; i++) {
+		v[hi_counts[tmp[i] >> 8]++] = tmp[i];
+	}
+}
+// counts the prefixes of the kmers starting at the positions [block_start, end) of the unpacked block
+static void count_block_kmer_prefixes(const char* bases, const seq_t block_start, const seq_t end, const uint32 k, uint32* counts) {
+	uint32 kmer = 0;
+	uint32 n_valid = 0; // number of unambiguous bases ending at i
+	for(seq_t i = 0; block_start + i < end + k - 1; i++) {
+		if(bases[i] == BASE_IGNORE) { // skip the kmers overlapping the ambiguous base
+			n_valid = 0;
+			continue;
+		}
+		kmer = (kmer << BITS_PER_CHAR) | bases[i];
+		if(++n_valid >= k) {
+			counts[(kmer << (BITS_IN_WORD - k*BITS_PER_CHAR)) >> (BITS_IN_WORD - KMER_HIST_PREFIX_BITS)]++;
+		}
+	}
+}
+
+void compute_store_kmer_hist(const char* refFname, const ref_t& ref, const index_params_t* params) {
+	compute_store_kmer_hist(refFname, ref, params, 0, ref_block_fn_t());
+}
+
+void compute_store_kmer_hist(const char* refFname, const ref_t& ref, const index_params_t* params, const uint32 block_fn_len, const ref_block_fn_t& block_fn) {
+	if(params->k > CHARS_PER_WORD) {
+		printf("compute_store_kmer_hist: The kmer histogram supports kmers of length up to %d!\n", CHARS_PER_WORD);
+		exit(1);
+	}
+	if(ref.len < params->k) {
+		printf("compute_store_kmer_hist: Reference %s is shorter than the kmer length!\n", refFname);
+		exit(1);
+	}
+	const double start_time = omp_get_wtime();
+	omp_set_num_threads(params->n_threads);
+	const uint32 n_prefixes = 1 << KMER_HIST_PREFIX_BITS;
+	const uint32 n_slices = params->n_threads;
+	const seq_t n_kmers = ref.len - params->k + 1;
+	const uint64 n_blocks = (ref.len + REF_BLOCK_SIZE - 1)/REF_BLOCK_SIZE;
+	const uint32 max_len = std::max((uint32) params->k, block_fn_len);
+	std::vector<seq_t> slice_starts(n_slices + 1); // (kmer positions)
+	for(uint32 s = 0; s <= n_slices; s++) {
+		slice_starts[s] = std::min((uint64) n_kmers, n_blocks*s/n_slices*REF_BLOCK_SIZE);
+	}
+
+	// 1. count the kmers of each prefix in each slice
+	std::vector<uint32> slice_counts((uint64) n_slices*n_prefixes);
+	#pragma omp parallel for schedule(static, 1)
+	for(uint32 s = 0; s < n_slices; s++) {
+		uint32* counts = &slice_counts[(uint64) s*n_prefixes];
+		std::vector<char> bases(REF_BLOCK_SIZE + max_len);
+		for(uint64 b = n_blocks*s/n_slices; b < n_blocks*(s + 1)/n_slices; b++) {
+			const seq_t block_start = b*REF_BLOCK_SIZE;
+			const seq_t n_bases = std::min((uint64) ref.len - block_start, (uint64) REF_BLOCK_SIZE + max_len - 1);
+			ref.seq.unpack(block_start, n_bases, bases.data());
+			if(block_start < n_kmers) {
+				count_block_kmer_prefixes(bases.data(), block_start, std::min((uint64) n_kmers, (uint64) block_start + REF_BLOCK_SIZE), params->k, counts);
+			}
+			if(block_fn) {
+				block_fn(block_start, bases.data(), n_bases);
+			}
+		}
+	}
+	std::vector<uint64> prefix_counts(n_prefixes + 1);
+	for(uint32 p = 0; p < n_prefixes; p++) {
+		for(uint32 s = 0; s < n_slices; s++) {
+			prefix_counts[p] += slice_counts[(uint64) s*n_prefixes + p];
+		}
+	}
+
+	// 2. split the prefixes into ranges within the memory budget (2 bytes per kmer)
+	const uint64 max_range_kmers = (params->mem_budget > 0) ? std::max((uint64) 1, params->mem_budget/sizeof(uint16_t)) : UINT64_MAX;
+	std::vector<uint32> range_starts(1, 0);
+	uint64 range_kmers = 0;
+	uint64 max_range_size = 0;
+	for(uint32 p = 0; p < n_prefixes; p++) {
+		if(range_kmers > 0 && range_kmers + prefix_counts[p] > max_range_kmers) {
+			range_starts.push_back(p);
+			range_kmers = 0;
+		}
+		range_kmers += prefix_counts[p];
+		max_range_size = std::max(max_range_size, range_kmers);
+	}
+	range_starts.push_back(n_prefixes);
+
+	std::string fname(refFname);
+	fname += std::string(".kmer_hist");
+	std::ofstream file;
+	file.open(fname.c_str(), std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		printf("compute_store_kmer_hist: Cannot open the hist file %s!\n", fname.c_str());
+		exit(1);
+	}
+	int map_size = 0;
+	file.write(reinterpret_cast<char*>(&map_size), sizeof(map_size)); // (updated at the end)
+
+	std::vector<uint16_t> suffixes(max_range_size);
+	std::vector<uint64> group_offsets(n_prefixes + 1);
+	std::vector<uint64> slice_offsets((uint64) n_slices*n_prefixes);
+	std::vector<std::vector<std::pair<uint32, uint32> > > freq_kmers(n_prefixes);
+	uint64 n_distinct = 0;
+	uint64 n_valid = 0;
+	for(uint32 r = 0; r + 1 < range_starts.size(); r++) {
+		const uint32 first_prefix = range_starts[r];
+		const uint32 last_prefix = range_starts[r + 1];
+		// 3. offset of each prefix group and of each slice in the group
+		uint64 offset = 0;
+		for(uint32 p = first_prefix; p < last_prefix; p++) {
+			group_offsets[p] = offset;
+			for(uint32 s = 0; s < n_slices; s++) {
+				slice_offsets[(uint64) s*n_prefixes + p] = offset;
+				offset += slice_counts[(uint64) s*n_prefixes + p];
+			}
+		}
+		group_offsets[last_prefix] = offset;
+
+		// 4. scatter the kmer suffixes of the range
+		#pragma omp parallel for schedule(static, 1)
+		for(uint32 s = 0; s < n_slices; s++) {
+			uint64* offsets = &slice_offsets[(uint64) s*n_prefixes];
+			for_each_ref_kmer(ref, params->k, slice_starts[s], slice_starts[s + 1],
+				[&](const seq_t pos, const uint32 kmer) {
+					const uint32 p = kmer >> (BITS_IN_WORD - KMER_HIST_PREFIX_BITS);
+					if(p >= first_prefix && p < last_prefix) {
+						suffixes[offsets[p]++] = kmer & ((1U << (BITS_IN_WORD - KMER_HIST_PREFIX_BITS)) - 1);
+					}
+				});
+		}
+
+		// 5. sort and count each prefix group
+		#pragma omp parallel reduction(+:n_distinct)
+		{
+		std::vector<uint16_t> tmp;
+		#pragma omp for schedule(dynamic, 64)
+		for(uint32 p = first_prefix; p < last_prefix; p++) {
+			uint16_t* group = &suffixes[group_offsets[p]];
+			const uint64 size = group_offsets[p + 1] - group_offsets[p];
+			sort_u16(group, size, tmp);
+			for(uint64 i = 0; i < size; ) {
+				uint64 j = i + 1;
+				while(j < size && group[j] == group[i]) j++;
+				if(j - i >= params->max_count) {
+					freq_kmers[p].push_back(std::make_pair(p << (BITS_IN_WORD - KMER_HIST_PREFIX_BITS) | group[i], (uint32) (j - i)));
+				}
+				n_distinct++;
+				i = j;
+			}
+		}
+		}
+		n_valid += offset;
+
+		// 6. store the frequent kmers of the range (in kmer order)
+		for(uint32 p = first_prefix; p < last_prefix; p++) {
+			for(uint64 i = 0; i < freq_kmers[p].size(); i++) {
+				file.write(reinterpret_cast<const char*>(&freq_kmers[p][i].first), sizeof(uint32));
+				file.write(reinterpret_cast<const char*>(&freq_kmers[p][i].second), sizeof(uint32));
+			}
+			map_size += freq_kmers[p].size();
+			std::vector<std::pair<uint32, uint32> >().swap(freq_kmers[p]);
+		}
+	}
+	file.seekp(0);
+	file.write(reinterpret_cast<char*>(&map_size), sizeof(map_size));
+	file.close();
+	std::ofstream threshold_file;
+	threshold_file.open((fname + ".H").c_str(), std::ios::out);
+	if (!threshold_file.is_open()) {
+		printf("compute_store_kmer_hist: Cannot open the hist threshold file %s.H!\n", fname.c_str());
+		exit(1);
+	}
+	threshold_file << params->max_count << " " << params->k << "\n";
+	threshold_file.close();
+	printf("Counted %llu kmers (%llu distinct) in %zu prefix range(s): %d kmers occur at least %llu times. Time: %.2f sec\n",
+			n_valid, n_distinct, range_starts.size() - 1, map_size, params->max_count, omp_get_wtime() - start_time);
 }
 
 // compute and store the frequency of each kmer in the given sequence (up to length 32)
@@ -214,8 +497,10 @@ void ref_kmer_repeat_stats(const char* fastaFname, index_params_t* params, ref_t
 	for(seq_t pos = 0; pos < ref.len - params->ref_window_size + 1; pos++) { // for each window of the genome
 		// generate the kmers of this window (pairs of kmers + pos)
 		std::vector<std::pair<minhash_t, seq_t>> kmers(n_kmers);
+		std::vector<char> window_seq(params->ref_window_size);
+		ref.seq.unpack(pos, params->ref_window_size, window_seq.data());
 		for(uint32 j = 0; j < n_kmers; j++) {
-			kmers[j] = std::make_pair(CityHash32(&ref.seq.c_str()[pos + j], params->k2), j);
+			kmers[j] = std::make_pair(CityHash32(&window_seq[j], params->k2), j);
 		}
 		std::sort(kmers.begin(), kmers.end());
 		int max_repeats = 0;
@@ -257,8 +542,10 @@ void ref_kmer_fingerprint_stats(const char* fastaFname, index_params_t* params,
 	for(seq_t pos = 0; pos < ref.len - params->ref_window_size + 1; pos++) { // for each window of the genome
 		// generate the kmers of this window (pairs of kmers + pos)
 		std::vector<std::pair<minhash_t, seq_t>> kmers(n_kmers);
+		std::vector<char> window_seq(params->ref_window_size);
+		ref.seq.unpack(pos, params->ref_window_size, window_seq.data());
 		for(uint32 j = 0; j < n_kmers; j++) {
-			kmers[j] = std::make_pair(CityHash32(&ref.seq.c_str()[pos + j], params->k2), j);
+			kmers[j] = std::make_pair(CityHash32(&window_seq[j], params->k2), j);
 		}
 		// sort the kmers
 		std::sort(kmers.begin(), kmers.end());
@@ -399,7 +686,7 @@ void kmer_stats(const char* refFname) {
 }
 
 void bin_repeat_stats(const char* fastaFname, index_params_t* params, ref_t& ref) {
-	mark_windows_to_discard(ref, params);
+	mark_windows_to_discard(ref, params, 0);
 
 	seq_t n_repeat_windows = 0;
 	#pragma omp parallel for reduction(+:n_repeat_windows)
@@ -442,22 +729,7 @@ void bin_repeat_stats(const char* fastaFname, index_params_t* params, ref_t& ref
 
 #define BUCKET_SIZE_THR_DEBUG 50000
 void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
-	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-	fname += std::to_string(params->n_buckets_pow2);
-	fname += std::string("_k");
-	fname += std::to_string(params->k);
-	fname += std::string("_H");
-	fname += std::to_string(params->max_count);
+	std::string fname = get_ref_idx_fname(refFname, "idx", params);
 	fname += std::string("__stats");
 
 	std::ofstream file;
@@ -468,9 +740,12 @@ void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_p
 	}
 
 	for(uint32 i = 0; i < params->n_tables; i++) {
-		const buckets_t& buckets = ref.mutable_index.per_table_buckets[i];
 		for(uint32 j = 0; j < params->n_buckets; j++) {
-			const VectorSeqPos& bucket = buckets.buckets_data_vectors[j];
+			const uint64 bid = i*params->n_buckets + j;
+			std::vector<loc_t> bucket(ref.index.bucket_size(bid));
+			for(uint32 k = 0; k < bucket.size(); k++) {
+				ref.index.get_entry(bid, ref.index.bucket_start(bid) + k, bucket[k]);
+			}
 			uint32 size = bucket.size();
 			uint32 len_avg = 0;
 			for(uint32 k = 0; k < size; k++) {
@@ -479,7 +754,7 @@ void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_p
 				if(size > BUCKET_SIZE_THR_DEBUG) {
 					printf("T %d b %d size %d pos %u \n", i, j, size, bucket[k].pos);
 					for(seq_t x = 0; x < params->ref_window_size; x++) {
-						printf("%c", iupacChar[(int) ref.seq[bucket[k].pos+x]]);
+						printf("%c", iupacChar[(int) ref.seq.get_base(bucket[k].pos+x)]);
 					}
 					printf("\n");
 				}
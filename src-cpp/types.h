@@ -44,6 +44,32 @@ typedef std::vector<bool> VectorBool;
 typedef std::vector<hash_t> VectorHash;
 typedef std::vector<minhash_t> VectorMinHash;
 
+// bitmap with direct access to its 64-bit words (bulk I/O)
+struct bitmap_t {
+	std::vector<uint64> words;
+	uint64 n_bits;
+
+	bitmap_t() : n_bits(0) {}
+
+	uint64 size() const {
+		return n_bits;
+	}
+	// (the added bits are 0)
+	void resize(const uint64 n) {
+		words.resize((n + 63)/64, 0);
+		if(n < n_bits && n % 64 != 0) {
+			words[n/64] &= (1ULL << (n % 64)) - 1;
+		}
+		n_bits = n;
+	}
+	inline bool operator[](const uint64 i) const {
+		return (words[i >> 6] >> (i & 63)) & 1;
+	}
+	inline void set(const uint64 i) {
+		words[i >> 6] |= 1ULL << (i & 63);
+	}
+};
+
 #if(USE_TBB)
 #include <tbb/tbb.h>
 #include "tbb/scalable_allocator.h"
@@ -60,6 +60,12 @@ struct voting_task {
 	inline void set_void_contig(const int contig_id) {
 		offsets[contig_id] = offsets[contig_id + 1];
 	} 
+	// contig with no ciphers to look up
+	inline void clear_contig(const int contig_id) {
+		if(get_contig_data_len(contig_id) > 0) {
+			memset(get_contig(contig_id), 0, get_contig_data_len(contig_id)*sizeof(kmer_cipher_t));
+		}
+	}
 
 	inline int get_read_data_len() const {
 		return offsets[0];